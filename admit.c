@@ -0,0 +1,210 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "admit.h"
+#include "proxy.h"
+#include "debug.h"
+#include "defines.h"
+
+static struct admitentry table[ADMIT_SETS][ADMIT_WAYS];
+static uint32_t rate = ADMIT_RATE;
+static uint32_t seed = 0;
+
+/* Requests per second we let each source address start. 0 turns rate limiting off */
+void admit_set_rate(unsigned r) {
+  rate = r;
+}
+
+/* Have the kernel throw away anything on the listener that can't be a request, before it
+ * wakes us up. The filter sees the UDP header, so the opcode is at offset 8 */
+int admit_attach_filter(int sockfd) {
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 8 + TFTP_STD_HEADER_SIZE, 0, 4),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 8),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, OP_RRQ, 1, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, OP_WRQ, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xffff),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+    perror("tftpserver: SO_ATTACH_FILTER");
+    return -1;
+  }
+  LOG(1, "Dropping non-request packets to the listener in the kernel");
+  return 0;
+}
+
+/* Keyed so nobody can line their sources up on one set and push everyone else out */
+static unsigned admit_hash(uint32_t addr) {
+  if (seed == 0) {
+    int fd;
+    if ((fd = open("/dev/urandom", O_RDONLY)) == -1 || read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+      seed = (uint32_t)getpid() * 2654435761u;
+    }
+    if (fd != -1) close(fd);
+    seed |= 1;
+  }
+  return ((addr ^ seed) * 2654435761u) >> 16 & (ADMIT_SETS - 1);
+}
+
+/* Find the entry for addr, taking over the least recently seen one in its set if it's new */
+static struct admitentry *admit_lookup(uint32_t addr, const struct timeval *now) {
+  struct admitentry *set = table[admit_hash(addr)];
+  struct admitentry *victim = &set[0];
+  int i;
+
+  for (i = 0; i < ADMIT_WAYS; i++) {
+    if (set[i].addr == addr) {
+      return &set[i];
+    }
+    if (timercmp(&set[i].last_seen, &victim->last_seen, <)) {
+      victim = &set[i];
+    }
+  }
+
+  memset(victim, 0, sizeof(*victim));
+  victim->addr = addr;
+  victim->microtokens = ADMIT_BURST * 1000000;
+  victim->last_seen = *now;
+  return victim;
+}
+
+/* Count a bad request against a source. Returns 1 once it has earned a block */
+static int admit_strike(struct admitentry *e, const struct timeval *now) {
+  if (now->tv_sec - e->first_strike >= ADMIT_WINDOW) {
+    e->strikes = 0;
+    e->first_strike = now->tv_sec;
+  }
+  if (++e->strikes < ADMIT_STRIKES) {
+    return 0;
+  }
+
+  e->blocked_until = now->tv_sec + ADMIT_BLOCK;
+  e->strikes = 0;
+  ERROR_MSG("Ignoring bad requests from %s for %i seconds", inet_ntoa(*(struct in_addr*)&e->addr), ADMIT_BLOCK);
+  return 1;
+}
+
+/* Is this a request we could act on? Mirrors the checks in handle_request, without a client */
+static int admit_valid(char *buf, int len, int *errcode, char **errmsg) {
+  char name[TFTP_MAX_REQ_BUF_SIZE];
+  unsigned short netshort;
+  int filename_len, mode_len;
+
+  if (len < TFTP_STD_HEADER_SIZE || len > TFTP_STD_HEADER_SIZE + TFTP_MAX_BUF_SIZE) {
+    *errcode = ERRCODE_ILLEGAL;
+    *errmsg = "Invalid packet length received";
+    return 0;
+  }
+
+  memcpy(&netshort, buf, 2);
+  if (ntohs(netshort) != OP_RRQ && ntohs(netshort) != OP_WRQ) {
+    // Data, acks and errors belong on a transfer's own port, never here
+    *errcode = ERRCODE_ILLEGAL;
+    *errmsg = "Invalid opcode given.";
+    return 0;
+  }
+
+  filename_len = strnlen(&buf[TFTP_REQ_HEADER_SIZE], len - TFTP_REQ_HEADER_SIZE);
+  if (filename_len < 1 || filename_len > TFTP_MAX_REQ_BUF_SIZE - 2 || TFTP_REQ_HEADER_SIZE + filename_len >= len) {
+    *errcode = ERRCODE_ILLEGAL;
+    *errmsg = "Malformed filename.";
+    return 0;
+  }
+
+  // The same name handle_request will strip the path down to
+  snprintf(name, sizeof(name), "%s", &buf[TFTP_REQ_HEADER_SIZE]);
+  if (strncmp(basename(name), PROXY_PART_PREFIX, strlen(PROXY_PART_PREFIX)) == 0) {
+    *errcode = ERRCODE_ACCESS;
+    *errmsg = "Access violation.";
+    return 0;
+  }
+
+  mode_len = strnlen(&buf[TFTP_REQ_HEADER_SIZE + filename_len + 1], len - TFTP_REQ_HEADER_SIZE - filename_len - 1);
+  if (mode_len < 1 || TFTP_REQ_HEADER_SIZE + filename_len + 1 + mode_len >= len) {
+    *errcode = ERRCODE_ILLEGAL;
+    *errmsg = "Malformed mode specification";
+    return 0;
+  }
+
+  if (strcmp(&buf[TFTP_REQ_HEADER_SIZE + filename_len + 1], "octet") != 0) {
+    *errcode = ERRCODE_UNKNOWN;
+    *errmsg = "Server does not support requested mode";
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Decide what to do with a datagram on the listener before we spend a socket or any memory on it.
+ * Returns ADMIT_OK, ADMIT_DROP, or ADMIT_REJECT with the error to send in errcode/errmsg */
+int admit_packet(char *buf, int len, const struct sockaddr_in *from, const struct timeval *now,
+                 int *errcode, char **errmsg) {
+  struct admitentry *e;
+  long long elapsed, tokens;
+
+  if (from->sin_family != AF_INET) {
+    return admit_valid(buf, len, errcode, errmsg) ? ADMIT_OK : ADMIT_REJECT;
+  }
+
+  e = admit_lookup(from->sin_addr.s_addr, now);
+
+  if (rate) {
+    // Refill the bucket for the time since we last heard from this source. In microseconds,
+    // since packets closer together than a millisecond would otherwise never earn anything
+    elapsed = (now->tv_sec - e->last_seen.tv_sec) * 1000000LL + (now->tv_usec - e->last_seen.tv_usec);
+    if (elapsed > 0) {
+      if (elapsed > ADMIT_BURST * 1000000LL) {
+        elapsed = ADMIT_BURST * 1000000LL;
+      }
+      tokens = e->microtokens + elapsed * rate;
+      e->microtokens = tokens > ADMIT_BURST * 1000000LL ? ADMIT_BURST * 1000000 : tokens;
+    }
+  }
+  e->last_seen = *now;
+
+  // Only dropped, not held against the source: a busy network segment behind one address
+  // going over the limit isn't misbehaving
+  if (rate && e->microtokens < 1000000) {
+    LOG(2, "Rate limiting %s", inet_ntoa(from->sin_addr));
+    return ADMIT_DROP;
+  }
+  if (rate) {
+    e->microtokens -= 1000000;
+  }
+
+  if (!admit_valid(buf, len, errcode, errmsg)) {
+    LOG(2, "Rejecting request from %s: %s", inet_ntoa(from->sin_addr), *errmsg);
+    // A block only covers bad requests, and they don't count against it further, so it runs out
+    // on time. Good ones still get through: spoofed junk mustn't lock the real source out
+    if (e->blocked_until > now->tv_sec) {
+      return ADMIT_DROP;
+    }
+    // A first offense gets told why. After that the source isn't worth answering, and a
+    // spoofed one can't use us to bounce error packets at somebody else
+    if (admit_strike(e, now) || e->strikes > 1) {
+      return ADMIT_DROP;
+    }
+    return ADMIT_REJECT;
+  }
+
+  return ADMIT_OK;
+}
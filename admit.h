@@ -0,0 +1,43 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#define ADMIT_SETS     1024 // source table is ADMIT_SETS x ADMIT_WAYS entries, never grows
+#define ADMIT_WAYS     4
+#define ADMIT_RATE     20   // requests per second per source address
+#define ADMIT_BURST    40
+#define ADMIT_STRIKES  20   // bad requests within ADMIT_WINDOW before we block a source
+#define ADMIT_WINDOW   10   // seconds
+#define ADMIT_BLOCK    60   // seconds a blocked source's bad requests are silently ignored
+#define ADMIT_BATCH    64   // datagrams taken off the listener per pass through the loop
+
+#define ADMIT_OK      0 // go ahead and set up a session
+#define ADMIT_DROP    1 // ignore silently
+#define ADMIT_REJECT  2 // answer with an error from the listener, then forget it
+
+/* What we remember about a source address */
+struct admitentry {
+  uint32_t addr; // network order; 0 for an unused entry
+  uint32_t microtokens; // token bucket, in millionths of a request
+  uint32_t strikes;
+  time_t first_strike;
+  time_t blocked_until;
+  struct timeval last_seen;
+};
+
+void admit_set_rate(unsigned rate);
+int admit_attach_filter(int sockfd);
+
+int admit_packet(char *buf, int len, const struct sockaddr_in *from, const struct timeval *now,
+                 int *errcode, char **errmsg);
@@ -0,0 +1,584 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+/* Microbenchmarks for the per-packet work in packet.c.
+ *
+ * Built by `make bench`, which links the server's modules against a stubbed socket layer:
+ * sendto() is wrapped to just count packets, and malloc/calloc/realloc are wrapped to count
+ * allocations made by server code. File I/O is real and happens in a scratch directory.
+ *
+ * The handoff case passes live transfers between two threads standing in for the old and new
+ * server, as an upgrade does, and fails the run (exit status 1) if any transfer is dropped.
+ *
+ * Usage: tftp-bench [iterations]
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "client.h"
+#include "packet.h"
+#include "iopool.h"
+#include "admit.h"
+#include "handoff.h"
+#include "defines.h"
+
+#define BENCH_FILE_SIZE  (4 << 20) // size of the files served by the RRQ cases
+#define BENCH_BUF_SIZE   (TFTP_STD_HEADER_SIZE + TFTP_MAX_BUF_SIZE + 16)
+
+/*** Stubbed socket layer and allocation counting ***/
+
+static unsigned long allocations = 0;
+static unsigned long packets_sent = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+ssize_t __wrap_sendto(int sockfd, const void *buf, size_t len, int flags,
+                      const struct sockaddr *dest_addr, socklen_t addrlen) {
+  packets_sent++;
+  return len;
+}
+
+/*** Timing ***/
+
+static struct timespec start_time;
+static unsigned long start_allocations;
+static int wakefd;
+static int nullfd;
+
+static void bench_start() {
+  start_allocations = allocations;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+static void bench_stop(const char *name, long packets) {
+  struct timespec end;
+  double ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = (end.tv_sec - start_time.tv_sec) * 1e9 + (end.tv_nsec - start_time.tv_nsec);
+  printf("%-36s %10li %12.1f %14.3f\n", name, packets, ns / packets,
+         (double)(allocations - start_allocations) / packets);
+}
+
+/*** Helpers ***/
+
+static void init_client(struct clientinfo *client, int request) {
+  memset(client, 0, sizeof(struct clientinfo));
+  client->sockfd = dup(nullfd); // never written to; close_client_connection needs something to close
+  client->address.sin_family = AF_INET;
+  client->address.sin_port = htons(12345);
+  client->len = sizeof(struct sockaddr_in);
+  client->request = request;
+}
+
+static void close_client(struct clientinfo *client) {
+  fd_set master;
+  FD_ZERO(&master);
+  close_client_connection(client, &master);
+}
+
+// Build an RRQ/WRQ with the given filename, mode and a number of (ignored) options
+static int make_request(char *buf, int op, const char *filename, const char *mode, int options) {
+  int len = TFTP_REQ_HEADER_SIZE;
+  int i;
+
+  buf[0] = 0;
+  buf[1] = op;
+  len += snprintf(&buf[len], TFTP_MAX_REQ_BUF_SIZE - len, "%s", filename) + 1;
+  len += snprintf(&buf[len], TFTP_MAX_REQ_BUF_SIZE - len, "%s", mode) + 1;
+  for (i = 0; i < options && len < TFTP_MAX_REQ_BUF_SIZE - 16; i++) {
+    len += snprintf(&buf[len], TFTP_MAX_REQ_BUF_SIZE - len, "opt%i", i) + 1;
+    len += snprintf(&buf[len], TFTP_MAX_REQ_BUF_SIZE - len, "%i", i * 512) + 1;
+  }
+  return len;
+}
+
+static int make_std(char *buf, int op, int block) {
+  buf[0] = 0;
+  buf[1] = op;
+  buf[2] = (block >> 8) & 0xff;
+  buf[3] = block & 0xff;
+  return TFTP_STD_HEADER_SIZE;
+}
+
+// Let the worker pool catch up with a client that's waiting on it
+static int wait_for_io(struct clientinfo *client, int rv) {
+  struct pollfd pfd = { wakefd, POLLIN, 0 };
+
+  while (rv == RETURN_PENDING || (client->waiting && rv != RETURN_CLOSECONN && rv != RETURN_ERR)) {
+    poll(&pfd, 1, -1);
+    iopool_collect();
+    if (client->io != NULL && client->io->wake) {
+      client->io->wake = 0;
+      rv = resume_client(client);
+    }
+    else if (client->image != NULL && client->image->progress) {
+      cimage_reap();
+      rv = resume_client(client);
+    }
+  }
+  return rv;
+}
+
+// Drain completions for clients we've already closed
+static void drain_io() {
+  struct pollfd pfd = { wakefd, POLLIN, 0 };
+  while (poll(&pfd, 1, 10) > 0) {
+    iopool_collect();
+  }
+}
+
+static void write_file(const char *path, int compress) {
+  char block[4096];
+  int i;
+
+  for (i = 0; i < sizeof(block); i++) {
+    block[i] = compress ? "kernel image "[i % 13] : rand();
+  }
+  if (compress) {
+    gzFile gz = gzopen(path, "wb");
+    for (i = 0; i < BENCH_FILE_SIZE / sizeof(block); i++) {
+      gzwrite(gz, block, sizeof(block));
+    }
+    gzwrite(gz, block, 100);
+    gzclose(gz);
+  }
+  else {
+    FILE *f = fopen(path, "wb");
+    for (i = 0; i < BENCH_FILE_SIZE / sizeof(block); i++) {
+      fwrite(block, 1, sizeof(block), f);
+    }
+    fwrite(block, 1, 100, f);
+    fclose(f);
+  }
+}
+
+/*** Cases ***/
+
+/* Parse a request without acting on it */
+static void bench_request(const char *name, char *buf, int len, long iterations) {
+  char path[TFTP_MAX_REQ_BUF_SIZE];
+  struct clientinfo client;
+  long i;
+
+  init_client(&client, 0);
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    handle_request(buf, path, len, &client);
+  }
+  bench_stop(name, iterations);
+  close(client.sockfd);
+}
+
+/* Dispatch packets that are rejected before reaching a handler's real work */
+static void bench_reject(const char *name, char *buf, int len, int request, long iterations) {
+  struct clientinfo client;
+  long i;
+
+  init_client(&client, request);
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    handle_packet(buf, len, &client);
+  }
+  bench_stop(name, iterations);
+  close(client.sockfd);
+}
+
+/* Serve a file: each ACK makes us send the next DATA packet */
+static void bench_rrq(const char *name, const char *filename, long iterations) {
+  char buf[BENCH_BUF_SIZE];
+  struct clientinfo client;
+  long i;
+  int rv;
+
+  init_client(&client, 0);
+  rv = handle_packet(buf, make_request(buf, OP_RRQ, filename, "octet", 0), &client);
+  wait_for_io(&client, rv);
+
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    rv = handle_packet(buf, make_std(buf, OP_ACK, client.last_block), &client);
+    rv = wait_for_io(&client, rv);
+    if (rv == RETURN_CLOSECONN) {
+      // Sent the whole file; start over
+      client.offset = 0;
+      client.last_block = 0;
+    }
+  }
+  bench_stop(name, iterations);
+
+  close_client(&client);
+  drain_io();
+}
+
+/* Receive a file: each DATA packet is buffered and acknowledged */
+static void bench_wrq(const char *name, long iterations) {
+  char buf[BENCH_BUF_SIZE];
+  struct clientinfo client;
+  long i;
+
+  unlink("upload");
+  init_client(&client, 0);
+  handle_packet(buf, make_request(buf, OP_WRQ, "upload", "octet", 0), &client);
+
+  memset(&buf[TFTP_STD_HEADER_SIZE], 'x', TFTP_MAX_BUF_SIZE);
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    int rv = handle_packet(buf, make_std(buf, OP_DATA, client_get_next_block(&client)) + TFTP_MAX_BUF_SIZE, &client);
+    wait_for_io(&client, rv);
+  }
+  bench_stop(name, iterations);
+
+  close_client(&client);
+  drain_io();
+  unlink("upload");
+}
+
+/* Accept an RRQ, open the file, queue the first read and tear it all down again */
+static void bench_accept(const char *name, long iterations) {
+  char buf[BENCH_BUF_SIZE];
+  struct clientinfo client;
+  int len = make_request(buf, OP_RRQ, "plain", "octet", 0);
+  struct pollfd pfd = { wakefd, POLLIN, 0 };
+  long i;
+
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    init_client(&client, 0);
+    handle_packet(buf, len, &client);
+    close_client(&client);
+    if (poll(&pfd, 1, 0) > 0) {
+      iopool_collect(); // frees the buffers of clients we closed with reads in flight
+    }
+  }
+  bench_stop(name, iterations);
+  drain_io();
+}
+
+/* Screen datagrams on the listener, one source or a spoofed source per packet */
+static void bench_admit(const char *name, char *buf, int len, int spoofed, long iterations) {
+  struct sockaddr_in from;
+  struct timeval now;
+  int errcode;
+  char *errmsg;
+  long i;
+
+  memset(&from, 0, sizeof(from));
+  from.sin_family = AF_INET;
+  from.sin_addr.s_addr = htonl(0x0a000001);
+  gettimeofday(&now, NULL);
+
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    if (spoofed) {
+      from.sin_addr.s_addr = htonl(0x0a000000 + i);
+    }
+    admit_packet(buf, len, &from, &now, &errcode, &errmsg);
+  }
+  bench_stop(name, iterations);
+}
+
+struct handoff_side {
+  int conn;
+  int listener;
+  struct clientinfo *clients;
+  int sent, dropped;
+};
+
+static void *handoff_old(void *arg) {
+  struct handoff_side *old = (struct handoff_side*)arg;
+  old->sent = handoff_send(old->conn, old->listener, old->clients, &old->dropped);
+  return NULL;
+}
+
+static void discard_clients(struct clientinfo **clients) {
+  fd_set master;
+  FD_ZERO(&master);
+  while (*clients != NULL) {
+    close_client_connection(*clients, &master);
+    delete_client(*clients, clients);
+  }
+}
+
+/* Hand a set of transfers over to a new server and back again, listener to ack. Returns -1 if
+ * a handoff didn't keep every transfer */
+static int bench_handoff(const char *name, int sessions, long rounds) {
+  char buf[BENCH_BUF_SIZE];
+  struct clientinfo *clients = NULL, *taken, *client;
+  struct sockaddr_in address;
+  struct handoff_side old;
+  pthread_t thread;
+  int pair[2], listener, resumed, dropped, i;
+  long r;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  for (i = 0; i < sessions; i++) {
+    address.sin_port = htons(20000 + i);
+    client = new_client(dup(nullfd), &address, sizeof(address), &clients);
+    wait_for_io(client, handle_packet(buf, make_request(buf, OP_RRQ, "plain", "octet", 0), client));
+  }
+  listener = dup(nullfd);
+
+  bench_start();
+  for (r = 0; r < rounds; r++) {
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) {
+      perror("socketpair");
+      return -1;
+    }
+    old.conn = pair[0];
+    old.listener = listener;
+    old.clients = clients;
+    pthread_create(&thread, NULL, handoff_old, &old);
+    taken = NULL;
+    resumed = handoff_recv(pair[1], &listener, &taken, &dropped);
+    pthread_join(thread, NULL);
+    close(pair[0]);
+    close(pair[1]);
+
+    // The old server exits, closing its copies
+    close(old.listener);
+    discard_clients(&clients);
+    clients = taken;
+
+    if (resumed != sessions || old.sent != sessions || dropped || old.dropped) {
+      printf("%-36s FAILED: %i of %i resumed, %i dropped by the new server, %i by the old\n", name,
+             resumed, sessions, dropped, old.dropped);
+      discard_clients(&clients);
+      drain_io();
+      return -1;
+    }
+  }
+  bench_stop(name, rounds);
+
+  discard_clients(&clients);
+  close(listener);
+  drain_io();
+  return 0;
+}
+
+// Send a packet from the canned upstream and let the proxy take it
+static void upstream_send(int up, struct fetch *fetch, char *buf, int len) {
+  struct pollfd pfd = { fetch->sockfd, POLLIN, 0 };
+  struct timeval now;
+  fd_set set;
+
+  send(up, buf, len, 0);
+  poll(&pfd, 1, 1000);
+  FD_ZERO(&set);
+  FD_SET(fetch->sockfd, &set);
+  gettimeofday(&now, NULL);
+  proxy_poll(&set, &now);
+}
+
+static int upstream_data(char *buf, int block, int blocks) {
+  int len = block == blocks ? 100 : PROXY_BLKSIZE;
+  memset(&buf[make_std(buf, OP_DATA, block)], block, len);
+  return TFTP_STD_HEADER_SIZE + len;
+}
+
+/* Fetch a file through the proxy from a canned upstream: an OACK for a bigger block and window,
+ * then windowed DATA with one block lost along the way. Returns -1 if the file didn't come
+ * through intact, or the rest of the window after the lost block drew more than one ACK */
+static int bench_proxy(const char *name, int blocks, long rounds) {
+  char buf[TFTP_STD_HEADER_SIZE + PROXY_BLKSIZE];
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  struct fetch *fetch;
+  struct stat st;
+  unsigned long acks;
+  int up, len, block, lost = blocks / 3, ok = 1;
+  long r, packets = 0;
+
+  // The upstream is a socket of our own on loopback
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((up = socket(AF_INET, SOCK_DGRAM, 0)) == -1 || bind(up, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+      getsockname(up, (struct sockaddr*)&addr, &addrlen) == -1) {
+    perror("upstream socket");
+    return -1;
+  }
+  snprintf(buf, sizeof(buf), "127.0.0.1:%i", ntohs(addr.sin_port));
+  proxy_set_upstream(buf);
+
+  bench_start();
+  for (r = 0; r < rounds && ok; r++) {
+    if ((fetch = proxy_fetch("fetched")) == NULL) {
+      perror("proxy_fetch");
+      return -1;
+    }
+    // The request went nowhere, sendto being stubbed, so give the fetch somewhere to be answered
+    addr.sin_port = 0;
+    bind(fetch->sockfd, (struct sockaddr*)&addr, sizeof(addr));
+    getsockname(fetch->sockfd, (struct sockaddr*)&addr, &addrlen);
+    connect(up, (struct sockaddr*)&addr, sizeof(addr));
+
+    buf[0] = 0;
+    buf[1] = OP_OACK;
+    len = 2;
+    len += sprintf(&buf[len], "blksize") + 1;
+    len += sprintf(&buf[len], "%i", PROXY_BLKSIZE) + 1;
+    len += sprintf(&buf[len], "windowsize") + 1;
+    len += sprintf(&buf[len], "%i", PROXY_WINDOWSIZE) + 1;
+    upstream_send(up, fetch, buf, len);
+    packets++;
+
+    for (block = 1; block <= blocks; block++) {
+      if (block == lost) {
+        // The rest of the window arrives without it: one ACK asks for it again
+        acks = packets_sent;
+        for (len = lost + 1; len < lost + PROXY_WINDOWSIZE && len < blocks; len++) {
+          upstream_send(up, fetch, buf, upstream_data(buf, len, blocks));
+          packets++;
+        }
+        ok &= packets_sent - acks == 1;
+      }
+      upstream_send(up, fetch, buf, upstream_data(buf, block, blocks));
+      packets++;
+    }
+
+    ok &= fetch->placed && stat("fetched", &st) == 0 && st.st_size == (blocks - 1) * PROXY_BLKSIZE + 100;
+    proxy_release(fetch);
+    proxy_reap();
+    unlink("fetched");
+  }
+  if (!ok) {
+    printf("%-36s FAILED: file incomplete, or a lost block drew more than one ACK\n", name);
+    close(up);
+    return -1;
+  }
+  bench_stop(name, packets);
+
+  close(up);
+  return 0;
+}
+
+static void bench_build(long iterations) {
+  struct clientinfo client;
+  long i;
+
+  init_client(&client, OP_RRQ);
+
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    send_ack(i, client);
+  }
+  bench_stop("build ACK", iterations);
+
+  bench_start();
+  for (i = 0; i < iterations; i++) {
+    send_error(ERRCODE_NOTFOUND, "File not found.", client);
+  }
+  bench_stop("build ERROR", iterations);
+
+  close(client.sockfd);
+}
+
+int main(int argc, char **argv) {
+  char dir[] = "/tmp/tftp-bench.XXXXXX";
+  char buf[BENCH_BUF_SIZE];
+  char longname[TFTP_MAX_REQ_BUF_SIZE];
+  long iterations = argc > 1 ? atol(argv[1]) : 100000;
+  int i, len, status = 0;
+
+  if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+    perror("scratch directory");
+    return 1;
+  }
+  if ((wakefd = iopool_init(IOPOOL_THREADS)) == -1) {
+    return 1;
+  }
+  nullfd = open("/dev/null", O_RDWR);
+  // The error paths log to stderr; keep paying for it, but don't show it
+  dup2(nullfd, STDERR_FILENO);
+
+  write_file("plain", 0);
+  write_file("image.gz", 1);
+
+  // A path with lots of directories for strip_path to cut through
+  for (i = 0; i < sizeof(longname) - 16; i++) {
+    longname[i] = (i % 8 == 7) ? '/' : 'd';
+  }
+  strcpy(&longname[i], "vmlinuz");
+
+  printf("%-36s %10s %12s %14s\n", "case", "packets", "ns/packet", "allocs/packet");
+
+  len = make_request(buf, OP_RRQ, "pxelinux.0", "octet", 0);
+  bench_request("request: short filename", buf, len, iterations);
+  len = make_request(buf, OP_RRQ, longname, "octet", 0);
+  bench_request("request: long nested filename", buf, len, iterations);
+  len = make_request(buf, OP_RRQ, "vmlinuz", "octet", 40);
+  bench_request("request: many options", buf, len, iterations);
+  len = make_request(buf, OP_RRQ, "vmlinuz", "netascii", 0);
+  bench_request("request: unsupported mode", buf, len, iterations);
+  // The whole buffer, so the parser runs off into 'a's rather than whatever was left there
+  memset(buf, 'a', sizeof(buf));
+  make_std(buf, OP_RRQ, 0x6161);
+  bench_request("request: unterminated", buf, TFTP_MAX_REQ_BUF_SIZE, iterations);
+
+  make_std(buf, 9, 0);
+  bench_reject("packet: bad opcode", buf, TFTP_STD_HEADER_SIZE, 0, iterations);
+  bench_reject("packet: runt", buf, 2, 0, iterations);
+  make_std(buf, OP_DATA, 1);
+  bench_reject("packet: DATA on a fresh TID", buf, TFTP_STD_HEADER_SIZE, 0, iterations);
+  make_std(buf, OP_ACK, 999);
+  bench_reject("packet: stale ACK", buf, TFTP_STD_HEADER_SIZE, OP_RRQ, iterations);
+
+  len = make_request(buf, OP_RRQ, "pxelinux.0", "octet", 0);
+  bench_admit("admit: request, spoofed sources", buf, len, 1, iterations);
+  bench_admit("admit: request flood, one source", buf, len, 0, iterations);
+  make_std(buf, OP_DATA, 1);
+  bench_admit("admit: DATA, spoofed sources", buf, TFTP_STD_HEADER_SIZE, 1, iterations);
+
+  bench_build(iterations);
+
+  bench_rrq("RRQ: ACK -> DATA (file)", "plain", iterations);
+  bench_rrq("RRQ: ACK -> DATA (gzip image)", "image", iterations);
+  bench_wrq("WRQ: DATA -> ACK (file)", iterations);
+  bench_accept("RRQ accept + close", iterations / 10);
+  if (bench_proxy("proxy: OACK + windowed DATA, 1 lost", 64, iterations / 100 + 1) == -1) {
+    status = 1;
+  }
+  if (bench_handoff("handoff: 64 transfers", 64, iterations / 1000 + 1) == -1) {
+    status = 1;
+  }
+
+  unlink("plain");
+  unlink("image.gz");
+  chdir("/");
+  rmdir(dir);
+  return status;
+}
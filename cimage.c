@@ -0,0 +1,501 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cimage.h"
+#include "debug.h"
+
+static struct cimage *images = NULL; // every image we have an index for
+
+/* Chunk cache, shared by all images */
+static struct cchunk *lru_head = NULL, *lru_tail = NULL;
+static size_t cache_used = 0;
+static size_t cache_budget = CIMAGE_DEFAULT_BUDGET;
+
+void cimage_set_budget(size_t bytes) {
+  cache_budget = bytes < CIMAGE_MIN_BUDGET ? CIMAGE_MIN_BUDGET : bytes;
+}
+
+static void image_free(struct cimage *image);
+
+static void lru_unlink(struct cchunk *c) {
+  if (c->prev) c->prev->next = c->next; else lru_head = c->next;
+  if (c->next) c->next->prev = c->prev; else lru_tail = c->prev;
+  c->prev = c->next = NULL;
+}
+
+static void lru_push(struct cchunk *c) {
+  c->next = lru_head;
+  if (lru_head) lru_head->prev = c; else lru_tail = c;
+  lru_head = c;
+}
+
+// Drop a chunk from the cache. Idle images go with their last chunk
+static void chunk_free(struct cchunk *c) {
+  struct cimage *image = c->image;
+
+  lru_unlink(c);
+  image->chunks[c->index] = NULL;
+  image->ncached--;
+  cache_used -= c->len;
+  free(c->data);
+  free(c);
+
+  if (image->refs == 0 && image->ncached == 0) {
+    image_free(image);
+  }
+}
+
+// Take ownership of data and put it in the cache, evicting old chunks to make room. The chunk
+// read last always stays: a read across a chunk boundary needs both, and a deflate block can
+// make a chunk far bigger than CIMAGE_SPAN, so the budget alone can't promise that
+static struct cchunk * cache_insert(struct cimage *image, unsigned index, char *data, size_t len) {
+  struct cchunk *c;
+
+  while (lru_tail != NULL && lru_tail != lru_head && cache_used + len > cache_budget) {
+    chunk_free(lru_tail);
+  }
+
+  c = (struct cchunk*)calloc(1, sizeof(struct cchunk));
+  c->image = image;
+  c->index = index;
+  c->data = data;
+  c->len = len;
+  lru_push(c);
+
+  image->chunks[index] = c;
+  image->ncached++;
+  cache_used += len;
+  return c;
+}
+
+static void cache_touch(struct cchunk *c) {
+  lru_unlink(c);
+  lru_push(c);
+}
+
+static int add_point(struct cimage *image, off_t out, off_t in, int bits, unsigned char *window) {
+  if (image->npoints == image->cap) {
+    unsigned cap = image->cap ? image->cap * 2 : 16;
+    struct cpoint *points = realloc(image->points, cap * sizeof(struct cpoint));
+    struct cchunk **chunks = realloc(image->chunks, cap * sizeof(struct cchunk*));
+    if (points) image->points = points;
+    if (chunks) image->chunks = chunks;
+    if (!points || !chunks) {
+      return -1;
+    }
+    image->cap = cap;
+  }
+  image->points[image->npoints].out = out;
+  image->points[image->npoints].in = in;
+  image->points[image->npoints].bits = bits;
+  image->points[image->npoints].window = window;
+  image->chunks[image->npoints] = NULL;
+  image->npoints++;
+  return 0;
+}
+
+/* A gzip member just ended: is another one next? Leaves its first bytes in the input buffer */
+static int next_member(struct cimage *image) {
+  z_stream *strm = &image->strm;
+
+  if (strm->avail_in < 2) {
+    ssize_t got;
+    memmove(image->inbuf, strm->next_in, strm->avail_in);
+    strm->next_in = image->inbuf;
+    if ((got = pread(image->fd, &image->inbuf[strm->avail_in], CIMAGE_INBUF - strm->avail_in, image->src_pos)) > 0) {
+      image->src_pos += got;
+      strm->avail_in += got;
+    }
+  }
+  return strm->avail_in >= 2 && strm->next_in[0] == 0x1f && strm->next_in[1] == 0x8b;
+}
+
+/* Advance the frontier decoder by one chunk: decode until we've produced at least CIMAGE_SPAN
+ * bytes and are sitting on a deflate block boundary, and note that spot. Runs on a worker */
+static void frontier_run(struct iojob *j) {
+  struct cjob *job = (struct cjob*)j;
+  struct cimage *image = job->image;
+  z_stream *strm = &image->strm;
+  int rv;
+
+  while (1) {
+    if (strm->avail_in == 0) {
+      ssize_t got = pread(image->fd, image->inbuf, CIMAGE_INBUF, image->src_pos);
+      if (got <= 0) {
+        ERROR_MSG("%s: %s", image->path, got == 0 ? "unexpected end of compressed data" : strerror(errno));
+        job->err = got == 0 ? EIO : errno;
+        return;
+      }
+      image->src_pos += got;
+      strm->next_in = image->inbuf;
+      strm->avail_in = got;
+    }
+
+    if (image->front_cap - image->front_len < CIMAGE_WINSIZE) {
+      size_t cap = image->front_cap ? image->front_cap * 2 : CIMAGE_SPAN + CIMAGE_WINSIZE;
+      char *front = realloc(image->front, cap);
+      if (front == NULL) {
+        job->err = ENOMEM;
+        return;
+      }
+      image->front = front;
+      image->front_cap = cap;
+    }
+    strm->next_out = (unsigned char*)&image->front[image->front_len];
+    strm->avail_out = image->front_cap - image->front_len;
+
+    rv = inflate(strm, Z_BLOCK);
+    image->front_len = (char*)strm->next_out - image->front;
+
+    if (rv == Z_STREAM_END) {
+      job->end.out = job->point.out + image->front_len;
+      if (next_member(image)) {
+        // gzip -d carries on into the next member, and so do we. It starts a chunk of its own,
+        // decoded from its header with no history
+        job->end.in = image->src_pos - strm->avail_in;
+        inflateReset(strm);
+      }
+      else {
+        if (strm->avail_in) {
+          ERROR_MSG("%s: ignoring trailing garbage after the compressed data", image->path);
+        }
+        job->last = 1;
+      }
+      break;
+    }
+    if (rv != Z_OK) {
+      ERROR_MSG("%s: %s", image->path, strm->msg ? strm->msg : "decompression failed");
+      job->err = EIO;
+      return;
+    }
+
+    /* Bit 128 is set at the end of a block, bit 64 if it was the last one */
+    if ((strm->data_type & 128) && !(strm->data_type & 64) && image->front_len >= CIMAGE_SPAN) {
+      if ((job->end.window = malloc(CIMAGE_WINSIZE)) == NULL) {
+        job->err = ENOMEM;
+        return;
+      }
+      memcpy(job->end.window, &image->front[image->front_len - CIMAGE_WINSIZE], CIMAGE_WINSIZE);
+      job->end.out = job->point.out + image->front_len;
+      job->end.in = image->src_pos - strm->avail_in;
+      job->end.bits = strm->data_type & 7;
+      break;
+    }
+  }
+
+  // The chunk goes to the job; the decoder carries on from where it is next time
+  job->data = image->front;
+  job->len = image->front_len;
+  image->front = NULL;
+  image->front_len = image->front_cap = 0;
+}
+
+/* Decode an indexed chunk again after it was evicted, starting from its point. Runs on a worker */
+static void decode_run(struct iojob *j) {
+  struct cjob *job = (struct cjob*)j;
+  struct cpoint *point = &job->point;
+  unsigned char inbuf[CIMAGE_INBUF];
+  off_t pos = point->in - (point->bits ? 1 : 0);
+  z_stream strm;
+  int rv = Z_OK;
+
+  if ((job->data = malloc(job->len ? job->len : 1)) == NULL) {
+    job->err = ENOMEM;
+    return;
+  }
+
+  memset(&strm, 0, sizeof(strm));
+  // Only the start of a gzip member has a header; everywhere else is raw deflate
+  if (inflateInit2(&strm, point->window ? -15 : 15 + 16) != Z_OK) {
+    job->err = ENOMEM;
+    return;
+  }
+  if (point->bits) {
+    if (pread(job->image->fd, inbuf, 1, pos) != 1) {
+      goto fail;
+    }
+    pos++;
+    inflatePrime(&strm, point->bits, inbuf[0] >> (8 - point->bits));
+  }
+  if (point->window) {
+    inflateSetDictionary(&strm, point->window, CIMAGE_WINSIZE);
+  }
+
+  strm.next_out = (unsigned char*)job->data;
+  strm.avail_out = job->len;
+  while (strm.avail_out && rv != Z_STREAM_END) {
+    if (strm.avail_in == 0) {
+      ssize_t got = pread(job->image->fd, inbuf, CIMAGE_INBUF, pos);
+      if (got <= 0) {
+        goto fail;
+      }
+      pos += got;
+      strm.next_in = inbuf;
+      strm.avail_in = got;
+    }
+    rv = inflate(&strm, Z_NO_FLUSH);
+    if (rv != Z_OK && rv != Z_STREAM_END) {
+      goto fail;
+    }
+  }
+  if (strm.avail_out) {
+    goto fail;
+  }
+
+  inflateEnd(&strm);
+  return;
+
+fail:
+  ERROR_MSG("%s: could not decode chunk %u", job->image->path, job->index);
+  inflateEnd(&strm);
+  job->err = EIO;
+}
+
+/* Back on the event loop: index and cache what the worker decoded, and let readers know */
+static void cjob_finish(struct iojob *j) {
+  struct cjob *job = (struct cjob*)j;
+  struct cimage *image = job->image;
+  struct cjob **p;
+
+  for (p = &image->jobs; *p != job; p = &(*p)->next);
+  *p = job->next;
+
+  if (!job->err && job->frontier) {
+    if (job->last) {
+      image->done = 1;
+      image->size = job->end.out;
+      inflateEnd(&image->strm);
+    }
+    else if (add_point(image, job->end.out, job->end.in, job->end.bits, job->end.window) == -1) {
+      free(job->end.window);
+      job->err = ENOMEM;
+    }
+  }
+
+  if (job->err) {
+    image->err = job->err;
+    free(job->data);
+  }
+  else {
+    LOG(2, "%s: %s chunk %u (%zu bytes)", image->path, job->frontier ? "indexed" : "decoded again", job->index, job->len);
+    cache_insert(image, job->index, job->data, job->len);
+  }
+
+  image->progress = 1;
+  free(job);
+  cimage_release(image);
+}
+
+/* Have a worker produce chunk index, unless one is already on it */
+static int cjob_submit(struct cimage *image, unsigned index) {
+  struct cjob *job;
+
+  for (job = image->jobs; job != NULL; job = job->next) {
+    if (job->index == index) {
+      return 0;
+    }
+  }
+  if ((job = (struct cjob*)calloc(1, sizeof(struct cjob))) == NULL) {
+    return -1;
+  }
+  job->image = image;
+  job->index = index;
+  job->point = image->points[index];
+  job->frontier = (index == image->npoints - 1 && !image->done);
+  if (!job->frontier) {
+    off_t end = (index + 1 < image->npoints) ? image->points[index + 1].out : image->size;
+    job->len = end - job->point.out;
+  }
+  job->job.run = job->frontier ? frontier_run : decode_run;
+  job->job.finish = cjob_finish;
+
+  image->refs++;
+  job->next = image->jobs;
+  image->jobs = job;
+  iopool_submit(&job->job);
+  return 0;
+}
+
+/* Read up to len decompressed bytes at offset. Returns the amount read (short only at the end
+ * of the image), IOPOOL_PENDING while a worker decodes what's needed, or -1 on error */
+int cimage_read(struct cimage *image, off_t offset, char *buf, int len) {
+  int total = 0;
+
+  if (image->err) {
+    errno = image->err;
+    return -1;
+  }
+
+  while (total < len) {
+    unsigned lo = 0, hi = image->npoints - 1, index;
+    struct cchunk *c;
+    size_t skip, amount;
+
+    if (image->done && offset >= image->size) {
+      break;
+    }
+
+    // Find the last point at or before offset
+    while (lo < hi) {
+      unsigned mid = (lo + hi + 1) / 2;
+      if (image->points[mid].out <= offset) lo = mid; else hi = mid - 1;
+    }
+    index = lo;
+
+    if ((c = image->chunks[index]) == NULL) {
+      // All or nothing: a short read would look like the end of the image
+      if (cjob_submit(image, index) == -1) {
+        return -1;
+      }
+      return IOPOOL_PENDING;
+    }
+    cache_touch(c);
+
+    skip = offset - image->points[index].out;
+    amount = c->len - skip;
+    if (amount > len - total) {
+      amount = len - total;
+    }
+    memcpy(&buf[total], &c->data[skip], amount);
+    total += amount;
+    offset += amount;
+
+    // Halfway through a chunk, start on the next so readers don't stall at the boundary
+    if (skip + amount > c->len / 2 && index + 1 < image->npoints && image->chunks[index + 1] == NULL) {
+      cjob_submit(image, index + 1);
+    }
+  }
+  return total;
+}
+
+/* Clear progress flags once clients have had a look */
+void cimage_reap() {
+  struct cimage *image;
+  for (image = images; image != NULL; image = image->next) {
+    image->progress = 0;
+  }
+}
+
+static void image_free(struct cimage *image) {
+  struct cimage **p;
+  unsigned i;
+
+  for (p = &images; *p != NULL; p = &(*p)->next) {
+    if (*p == image) {
+      *p = image->next;
+      break;
+    }
+  }
+
+  // Freeing a chunk can recurse back here once the last one is gone, so detach first
+  image->refs = 1;
+  for (i = 0; i < image->npoints; i++) {
+    if (image->chunks[i]) {
+      chunk_free(image->chunks[i]);
+    }
+    free(image->points[i].window);
+  }
+  if (!image->done) {
+    inflateEnd(&image->strm);
+  }
+
+  LOG(2, "Dropped index for %s", image->path);
+  close(image->fd);
+  free(image->points);
+  free(image->chunks);
+  free(image->front);
+  free(image->path);
+  free(image);
+}
+
+/* Look for a compressed copy of path and start serving it. Sets errno and returns NULL
+ * if there isn't one */
+struct cimage * cimage_open(const char *path) {
+  struct cimage *image;
+  struct stat st;
+  char *gzpath;
+
+  if ((gzpath = malloc(strlen(path) + sizeof(CIMAGE_SUFFIX))) == NULL) {
+    return NULL;
+  }
+  strcpy(gzpath, path);
+  strcat(gzpath, CIMAGE_SUFFIX);
+
+  if (stat(gzpath, &st) == -1) {
+    int err = errno;
+    free(gzpath);
+    errno = err; // callers tell a missing image (ENOENT) apart from one they can't read
+    return NULL;
+  }
+
+  // Reuse the index we already have unless the file was replaced underneath us
+  for (image = images; image != NULL; image = image->next) {
+    if (strcmp(image->path, gzpath) != 0) {
+      continue;
+    }
+    if (image->st.st_ino == st.st_ino && image->st.st_dev == st.st_dev && image->st.st_size == st.st_size &&
+        image->st.st_mtim.tv_sec == st.st_mtim.tv_sec && image->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+      free(gzpath);
+      image->refs++;
+      return image;
+    }
+    // Stale. Clients still reading it keep their copy; new ones get a fresh index
+    LOG(1, "%s changed on disk, re-indexing", gzpath);
+    if (image->refs == 0) {
+      image_free(image);
+    }
+    else {
+      struct cimage **p;
+      for (p = &images; *p != image; p = &(*p)->next);
+      *p = image->next;
+      image->next = NULL;
+    }
+    break;
+  }
+
+  if ((image = (struct cimage*)calloc(1, sizeof(struct cimage))) == NULL) {
+    free(gzpath);
+    return NULL;
+  }
+  image->path = gzpath;
+  image->st = st;
+  image->refs = 1;
+
+  if ((image->fd = open(gzpath, O_RDONLY)) == -1 ||
+      inflateInit2(&image->strm, 15 + 16) != Z_OK || // 16: expect a gzip header
+      add_point(image, 0, 0, 0, NULL) == -1) {
+    int err = errno;
+    if (image->fd != -1) close(image->fd);
+    free(image->points);
+    free(image->chunks);
+    free(gzpath);
+    free(image);
+    errno = err;
+    return NULL;
+  }
+
+  image->next = images;
+  images = image;
+
+  LOG(1, "Serving compressed image %s", gzpath);
+  return image;
+}
+
+/* A client is done with the image. The index stays around as long as any of its chunks are cached */
+void cimage_release(struct cimage *image) {
+  if (--image->refs == 0 && image->ncached == 0) {
+    image_free(image);
+  }
+}
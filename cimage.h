@@ -0,0 +1,92 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "iopool.h"
+
+#define CIMAGE_SUFFIX         ".gz"
+#define CIMAGE_SPAN           (1 << 20) // decompressed bytes between index points
+#define CIMAGE_WINSIZE        32768     // deflate history needed to resume at a point
+#define CIMAGE_INBUF          16384
+#define CIMAGE_DEFAULT_BUDGET (64 << 20) // bytes of decompressed chunks kept in memory
+#define CIMAGE_MIN_BUDGET     (4 * CIMAGE_SPAN) // a read spanning two chunks needs both cached at once
+
+/* A place we can restart decompression from. Chunk i covers points[i].out up to points[i+1].out */
+struct cpoint {
+  off_t out; // decompressed offset
+  off_t in; // compressed offset of the first whole byte
+  int bits; // bits of the byte before 'in' that still need decoding
+  unsigned char *window; // the output preceding this point (NULL for the start of a gzip member)
+};
+
+/* A decompressed chunk held in the cache */
+struct cchunk {
+  struct cimage *image;
+  unsigned index;
+  char *data;
+  size_t len;
+  struct cchunk *prev, *next; // LRU list, most recently used at the head
+};
+
+/* Decoding handed to the worker pool. Workers only touch the job and, for the frontier, the
+ * image's frontier decoder; the index and cache are updated back on the event loop */
+struct cjob {
+  struct iojob job;
+  struct cimage *image; // holds a reference until the job finishes
+  unsigned index; // chunk being produced
+  int frontier; // 1 to advance the frontier decoder, 0 to decode an indexed chunk again
+  struct cpoint point; // where the chunk starts
+  size_t len; // bytes to decode again
+  char *data; // the chunk
+  struct cpoint end; // frontier only: the point after the chunk
+  int last; // frontier only: the chunk runs to the end of the image
+  int err; // errno on failure, else 0
+  struct cjob *next; // image's jobs in flight
+};
+
+/* A gzip-compressed image, shared by every client reading it */
+struct cimage {
+  char *path; // path of the compressed file
+  int fd;
+  struct stat st; // so we notice the file being replaced
+  unsigned refs; // clients currently reading this image
+
+  struct cpoint *points;
+  struct cchunk **chunks; // cached chunk for each point, or NULL
+  unsigned npoints, cap;
+  unsigned ncached;
+
+  struct cjob *jobs; // decodes in flight
+  int err; // a decode failed; every read fails with this
+  int progress; // a decode finished since the event loop last looked
+
+  /* The decoder at the edge of what we've indexed so far. Only the frontier job touches it */
+  z_stream strm;
+  off_t src_pos; // next compressed byte to read into inbuf
+  unsigned char inbuf[CIMAGE_INBUF];
+  char *front; // output of the chunk being decoded
+  size_t front_len, front_cap;
+  int done; // reached the end of the stream; size is valid
+  off_t size;
+
+  struct cimage *next;
+};
+
+void cimage_set_budget(size_t bytes);
+
+struct cimage * cimage_open(const char *path);
+void cimage_release(struct cimage *image);
+
+int cimage_read(struct cimage *image, off_t offset, char *buf, int len);
+void cimage_reap();
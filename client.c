@@ -11,16 +11,27 @@
 #include "client.h"
 #include "packet.h"
 #include "defines.h"
+#include "probes.h"
 
 /* Clean up sockets and open files */
 int close_client_connection(struct clientinfo *client, fd_set *masterset) {
   LOG(1, "Closing connection to client %i", client->address.sin_port);
+  PROBE(close, client_get_tid(*client), client->last_block, (long long)client->offset, client->timeouts);
   close(client->sockfd);
   FD_CLR(client->sockfd, masterset);
 
+  if (client->io != NULL) {
+    iopool_close(client->io);
+  }
   if (client->file != NULL) {
     fclose(client->file);
   }
+  if (client->image != NULL) {
+    cimage_release(client->image);
+  }
+  if (client->fetch != NULL) {
+    proxy_release(client->fetch);
+  }
 
   return 0;
 }
@@ -28,7 +39,7 @@ int close_client_connection(struct clientinfo *client, fd_set *masterset) {
 // go back in the file so we can resend
 int rewind_client_file(struct clientinfo *client) {
   if (client->last_block) {
-    fseek(client->file, -client->last_amount_written, SEEK_CUR);
+    client->offset -= client->last_amount_written;
     client->last_block--;
   }
   return 0;
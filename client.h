@@ -18,6 +18,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "digest.h"
+#include "cimage.h"
+#include "iopool.h"
+#include "proxy.h"
+
 
 /* The structure for maintaining client state */
 struct clientinfo {
@@ -25,11 +30,17 @@ struct clientinfo {
   socklen_t len; // address memory length
   int sockfd; // our socket's file descriptor for this client
   FILE* file; // the FILE we're reading/writing to
+  struct cimage *image; // compressed image we're serving from instead of file
+  struct prefetch *io; // worker pool buffers for file
+  struct fetch *fetch; // upstream fetch we're serving from instead of file
+  off_t offset; // our position in file or image
+  int waiting; // 1 while we can't answer the client until disk I/O finishes
   unsigned last_block; // The last block we sent/received
   unsigned last_amount_written; // how much we wrote last time (so we can rewind the file)
   struct timeval last_time; // timestamp of last message received (for timeouts)
   unsigned request; // type of request (RRQ or WRQ, or 0 if not set yet. Used for error checking)
   unsigned timeouts; // How many times we've timed out--after MAX_TIMEOUTS we'll disconnect
+  struct digest digest; // running digest of the bytes transferred so far
 
   struct clientinfo *next; // simple linked list
 };
@@ -23,6 +23,7 @@
 #define OP_DATA  3
 #define OP_ACK   4
 #define OP_ERROR 5
+#define OP_OACK  6 // option acknowledgement (RFC 2347), only seen from an upstream
 
 #define ERRCODE_UNKNOWN  0
 #define ERRCODE_NOTFOUND 1
@@ -36,5 +37,6 @@
 #define RETURN_STD       1
 #define RETURN_CLOSECONN 2
 #define RETURN_IGNORE    3
+#define RETURN_PENDING   4 // waiting on disk I/O; resume_client picks it back up
 #define RETURN_ERR       -1
 
@@ -0,0 +1,288 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "digest.h"
+#include "debug.h"
+
+static int sha256_enabled = 0;
+
+void digest_set_sha256(int enabled) {
+  sha256_enabled = enabled;
+}
+
+/*** CRC32C (Castagnoli) ***/
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  while (len--) {
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 has a dedicated instruction for this polynomial, 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (len--) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len) = NULL;
+
+// Pick the fastest implementation the first time we're called
+static void crc32c_setup() {
+  uint32_t i, j, c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++) {
+      c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+    }
+    crc32c_table[i] = c;
+  }
+  crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_impl = crc32c_hw;
+  }
+#endif
+  LOG(2, "Using %s CRC32C", crc32c_impl == crc32c_sw ? "table-driven" : "hardware");
+}
+
+/* Continue a CRC32C. Pass and receive the crc pre-inverted (start with ~0, finish with ~crc) */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  if (crc32c_impl == NULL) {
+    crc32c_setup();
+  }
+  return crc32c_impl(crc, data, len);
+}
+
+/*** SHA-256 (FIPS 180-4) ***/
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform(struct sha256_ctx *ctx, const unsigned char *block) {
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) |
+           ((uint32_t)block[i*4+2] << 8) | (uint32_t)block[i*4+3];
+  }
+  for (i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+    uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+
+  a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+  e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+  for (i = 0; i < 64; i++) {
+    t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+  ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256_init(struct sha256_ctx *ctx) {
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(ctx->state, iv, sizeof(iv));
+  ctx->length = 0;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const unsigned char *data, size_t len) {
+  size_t used = ctx->length % 64;
+  ctx->length += len;
+
+  // Top up a partial block first
+  if (used) {
+    size_t fill = 64 - used;
+    if (len < fill) {
+      memcpy(&ctx->block[used], data, len);
+      return;
+    }
+    memcpy(&ctx->block[used], data, fill);
+    sha256_transform(ctx, ctx->block);
+    data += fill;
+    len -= fill;
+  }
+  for (; len >= 64; data += 64, len -= 64) {
+    sha256_transform(ctx, data);
+  }
+  memcpy(ctx->block, data, len);
+}
+
+static void sha256_final(struct sha256_ctx *ctx, unsigned char *out) {
+  uint64_t bits = ctx->length * 8;
+  unsigned char pad[72] = { 0x80 };
+  size_t used = ctx->length % 64;
+  size_t padlen = (used < 56) ? 56 - used : 120 - used;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    pad[padlen + i] = bits >> (56 - 8 * i);
+  }
+  sha256_update(ctx, pad, padlen + 8);
+
+  for (i = 0; i < 8; i++) {
+    out[i*4]   = ctx->state[i] >> 24;
+    out[i*4+1] = ctx->state[i] >> 16;
+    out[i*4+2] = ctx->state[i] >> 8;
+    out[i*4+3] = ctx->state[i];
+  }
+}
+
+/*** Transfer digests ***/
+
+void digest_init(struct digest *d) {
+  memset(d, 0, sizeof(struct digest));
+  d->active = 1;
+  d->crc = ~0U;
+  d->use_sha256 = sha256_enabled;
+  if (d->use_sha256) {
+    sha256_init(&d->sha);
+  }
+}
+
+/* Fold in data that was read from/written to file offset pos. Blocks that are sent or
+ * written again after a rewind overlap what we've already seen, so only the unseen tail
+ * is hashed. A gap means we lost track of the file, so we give up on this transfer. */
+void digest_update_at(struct digest *d, long pos, const char *data, int len) {
+  long skip;
+
+  if (!d->active || len <= 0 || pos + len <= d->offset) {
+    return;
+  }
+  if (pos > d->offset) {
+    ERROR_MSG("Digest lost track of file (at %li, expected %li). Not recording digest", pos, d->offset);
+    d->active = 0;
+    return;
+  }
+
+  skip = d->offset - pos;
+  d->crc = crc32c(d->crc, data + skip, len - skip);
+  if (d->use_sha256) {
+    sha256_update(&d->sha, (const unsigned char*)data + skip, len - skip);
+  }
+  d->offset += len - skip;
+}
+
+// Build the xattr value for a file of the given size/mtime. Returns the length
+static int digest_format(struct digest *d, const struct stat *st, char *out) {
+  int len;
+
+  len = snprintf(out, DIGEST_XATTR_SIZE, "size=%lld mtime=%lld.%09ld crc32c=%08x",
+                 (long long)st->st_size, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec, ~d->crc);
+
+  if (d->use_sha256) {
+    unsigned char sha[SHA256_DIGEST_SIZE];
+    int i;
+    sha256_final(&d->sha, sha);
+    len += snprintf(&out[len], DIGEST_XATTR_SIZE - len, " sha256=");
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+      len += snprintf(&out[len], DIGEST_XATTR_SIZE - len, "%02x", sha[i]);
+    }
+  }
+  return len;
+}
+
+/* Check the file for a digest recorded by a previous transfer. If it still matches the
+ * file's size and mtime we can skip hashing entirely. Returns 1 if the cache was used */
+int digest_load(struct digest *d, int fd) {
+  char value[DIGEST_XATTR_SIZE];
+  char expect[DIGEST_XATTR_SIZE];
+  struct stat st;
+  ssize_t len;
+  int prefix;
+
+  if (!d->active || fstat(fd, &st) == -1) {
+    return 0;
+  }
+  if ((len = fgetxattr(fd, DIGEST_XATTR, value, sizeof(value) - 1)) <= 0) {
+    return 0;
+  }
+  value[len] = '\0';
+
+  // The size/mtime prefix has to match exactly, and we need a sha256 if one is wanted
+  prefix = snprintf(expect, sizeof(expect), "size=%lld mtime=%lld.%09ld ",
+                    (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+  if (strncmp(value, expect, prefix) != 0 || (d->use_sha256 && strstr(value, "sha256=") == NULL)) {
+    LOG(2, "Cached digest is stale, recomputing");
+    return 0;
+  }
+
+  LOG(1, "Using cached digest: %s", &value[prefix]);
+  d->active = 0;
+  d->cached = 1;
+  return 1;
+}
+
+/* Record the finished digest on the file. Only call this once the whole file has
+ * passed through; a partial digest is worse than none */
+int digest_store(struct digest *d, int fd) {
+  char value[DIGEST_XATTR_SIZE];
+  struct stat st;
+  int len;
+
+  if (!d->active) {
+    return 0;
+  }
+  d->active = 0;
+
+  if (fstat(fd, &st) == -1 || st.st_size != d->offset) {
+    ERROR_MSG("Digest covers %li bytes but file has changed. Not recording digest", d->offset);
+    return -1;
+  }
+
+  len = digest_format(d, &st, value);
+  LOG(1, "Transfer digest: %s", value);
+
+  if (fsetxattr(fd, DIGEST_XATTR, value, len, 0) == -1) {
+    ERROR_MSG("Could not record digest: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Extended attribute the digest is recorded under, next to the file it describes */
+#define DIGEST_XATTR        "user.tftp.digest"
+#define DIGEST_XATTR_SIZE   160
+
+#define SHA256_DIGEST_SIZE  32
+
+struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t length; // total bytes hashed
+  unsigned char block[64]; // partial input block
+};
+
+/* Running digest of a file as it passes through a transfer */
+struct digest {
+  int active; // 1 while we are computing, 0 if disabled, invalid or cached
+  int cached; // the digest was loaded from the file's xattr; nothing to compute
+  long offset; // how many bytes from the start of the file have been folded in
+  uint32_t crc; // running CRC32C (pre-inverted)
+  int use_sha256;
+  struct sha256_ctx sha;
+};
+
+void digest_set_sha256(int enabled);
+
+void digest_init(struct digest *d);
+void digest_update_at(struct digest *d, long pos, const char *data, int len);
+
+int digest_load(struct digest *d, int fd);
+int digest_store(struct digest *d, int fd);
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
@@ -0,0 +1,352 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "packet.h"
+#include "pcache.h"
+#include "debug.h"
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    ERROR_MSG("Upgrade socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/* Wait at path for the next version of the server to ask for our sessions */
+int handoff_listen(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (handoff_addr(path, &addr) == -1) {
+    return -1;
+  }
+  if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+    perror("tftpserver: upgrade socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+    perror("tftpserver: upgrade socket");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Find a running server at path to take over from. Returns -1 if there isn't one */
+int handoff_connect(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (handoff_addr(path, &addr) == -1) {
+    return -1;
+  }
+  if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int send_msg(int conn, struct handoff_msg *msg, int *fds, int nfds) {
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = { msg, sizeof(*msg) };
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (nfds) {
+    memset(control, 0, sizeof(control));
+    mh.msg_control = control;
+    mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+
+  msg->version = HANDOFF_VERSION;
+  // The other end going away is an error to handle, not a reason to die
+  if (sendmsg(conn, &mh, MSG_NOSIGNAL) != sizeof(*msg)) {
+    perror("tftpserver: handoff");
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns the number of descriptors received into fds, or -1 */
+static int recv_msg(int conn, struct handoff_msg *msg, int *fds, int flags) {
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = { msg, sizeof(*msg) };
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+  ssize_t got;
+  int nfds = 0;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof(control);
+
+  memset(msg, 0, sizeof(*msg));
+  got = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC | flags);
+  for (cmsg = CMSG_FIRSTHDR(&mh); got != -1 && cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+  }
+  // Anything from a later version than ours is cut short to the fields we know about
+  if (got < (ssize_t)HANDOFF_MIN_SIZE || msg->version < 1) {
+    // Whatever came with it is ours now; holding on to the listener would keep anyone from binding
+    while (nfds--) close(fds[nfds]);
+    ERROR_MSG("Bad message on the upgrade socket");
+    return -1;
+  }
+  return nfds;
+}
+
+/* Describe a session for the new process. Returns 0 if it can't be moved */
+static int pack_session(struct clientinfo *client, struct handoff_msg *msg, int *fds, int *nfds) {
+  memset(msg, 0, sizeof(*msg));
+  msg->kind = HANDOFF_SESSION;
+  msg->request = client->request;
+  msg->last_block = client->last_block;
+  msg->last_amount_written = client->last_amount_written;
+  msg->timeouts = client->timeouts;
+  msg->waiting = client->waiting;
+  msg->policy = client->io != NULL ? client->io->policy : PCACHE_DEFAULT;
+  msg->offset = client->offset;
+  msg->last_sec = client->last_time.tv_sec;
+  msg->last_usec = client->last_time.tv_usec;
+  msg->address = client->address;
+  msg->digest_size = sizeof(struct digest);
+  msg->digest = client->digest;
+
+  fds[0] = client->sockfd;
+  *nfds = 1;
+
+  if (client->io != NULL && (client->io->err || (client->request == OP_WRQ && client->io->inflight))) {
+    // Writes that failed, or didn't make it to disk in time
+    return 0;
+  }
+  if (client->file != NULL) {
+    msg->source = HANDOFF_SOURCE_FILE;
+    fds[(*nfds)++] = fileno(client->file);
+  }
+  else if (client->image != NULL) {
+    msg->source = HANDOFF_SOURCE_IMAGE;
+    snprintf(msg->name, sizeof(msg->name), "%.*s", (int)(strlen(client->image->path) - strlen(CIMAGE_SUFFIX)),
+             client->image->path);
+  }
+  else if (client->fetch != NULL && client->fetch->placed) {
+    msg->source = HANDOFF_SOURCE_NAME;
+    snprintf(msg->name, sizeof(msg->name), "%s", client->fetch->name);
+  }
+  else {
+    // The upstream transfer can't follow us; neither can a client that hasn't got a request in yet
+    return 0;
+  }
+  return 1;
+}
+
+/* Hand the listener and every session we can over to the new process. Once it acknowledges, the
+ * sessions that couldn't be moved are told so and counted in dropped, along with any it couldn't
+ * resume. Returns the number of sessions it took over, or -1 if it didn't take over and everything
+ * is still ours */
+int handoff_send(int conn, int listener, struct clientinfo *clients, int *dropped) {
+  struct handoff_msg msg, ack;
+  struct pollfd pfd = { conn, POLLIN, 0 };
+  struct clientinfo *p;
+  int fds[2], nfds;
+
+  *dropped = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.kind = HANDOFF_LISTENER;
+  if (send_msg(conn, &msg, &listener, 1) == -1) {
+    return -1;
+  }
+
+  for (p = clients; p != NULL; p = p->next) {
+    if (pack_session(p, &msg, fds, &nfds) && send_msg(conn, &msg, fds, nfds) == -1) {
+      return -1;
+    }
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.kind = HANDOFF_END;
+  if (send_msg(conn, &msg, NULL, 0) == -1) {
+    return -1;
+  }
+
+  // If it's gone quiet, shut it out so a late ack can't get through: then it can't start serving
+  // once we've decided to carry on. An ack that got in first still counts
+  if (poll(&pfd, 1, HANDOFF_TIMEOUT * 1000) != 1) {
+    shutdown(conn, SHUT_RDWR);
+  }
+  if ((nfds = recv_msg(conn, &ack, fds, MSG_DONTWAIT)) != 0 || ack.kind != HANDOFF_ACK) {
+    while (nfds > 0) close(fds[--nfds]);
+    ERROR_MSG("The new server did not take over");
+    return -1;
+  }
+
+  for (p = clients; p != NULL; p = p->next) {
+    if (!pack_session(p, &msg, fds, &nfds)) {
+      send_error(ERRCODE_UNKNOWN, "Server restarting.", *p);
+      (*dropped)++;
+    }
+  }
+  *dropped += ack.dropped;
+  return ack.taken;
+}
+
+/* Pick up where the old session left off. Returns 0 if we couldn't */
+static int unpack_session(struct handoff_msg *msg, int *fds, int nfds, struct clientinfo **clients) {
+  struct clientinfo *client;
+  int policy;
+
+  client = new_client(fds[0], &msg->address, sizeof(struct sockaddr_in), clients);
+  client->request = msg->request;
+  client->last_block = msg->last_block;
+  client->last_amount_written = msg->last_amount_written;
+  client->timeouts = msg->timeouts;
+  client->waiting = msg->waiting;
+  client->offset = msg->offset;
+  client->last_time.tv_sec = msg->last_sec;
+  client->last_time.tv_usec = msg->last_usec;
+  if (msg->digest_size == sizeof(struct digest)) {
+    client->digest = msg->digest;
+  }
+
+  switch (msg->source) {
+    case HANDOFF_SOURCE_FILE:
+      if (nfds < 2) {
+        return 0;
+      }
+      if ((client->file = fdopen(fds[1], client->request == OP_WRQ ? "wb" : "rb")) == NULL) {
+        close(fds[1]);
+        return 0;
+      }
+      // Version 1 didn't say, and left the cache alone
+      policy = msg->version >= 2 ? msg->policy : PCACHE_DEFAULT;
+      if ((client->io = iopool_open(fds[1], client->request == OP_WRQ, policy)) == NULL) {
+        return 0;
+      }
+      return 1;
+
+    case HANDOFF_SOURCE_IMAGE:
+      return (client->image = cimage_open(msg->name)) != NULL;
+
+    case HANDOFF_SOURCE_NAME:
+      if ((client->file = fopen(msg->name, "rb")) == NULL) {
+        return 0;
+      }
+      if ((client->io = iopool_open(fileno(client->file), 0, pcache_policy(msg->name, fileno(client->file), 0))) == NULL) {
+        return 0;
+      }
+      return 1;
+  }
+  return 0;
+}
+
+/* Forget a list of sessions without a word to the clients */
+static void discard_sessions(struct clientinfo **clients) {
+  fd_set scratch;
+
+  FD_ZERO(&scratch);
+  while (*clients != NULL) {
+    close_client_connection(*clients, &scratch);
+    delete_client(*clients, clients);
+  }
+}
+
+/* Take over the listener and sessions from the old process. Sessions we couldn't reopen are told
+ * so and counted in dropped. Returns the number of sessions taken over, or -1 if we didn't take
+ * over: then nothing has been kept and the old process still serves it all */
+int handoff_recv(int conn, int *listener, struct clientinfo **clients, int *dropped) {
+  struct handoff_msg msg;
+  struct clientinfo *client, *failed = NULL;
+  int fds[2], nfds;
+  int taken = 0, ended = 0;
+  uint32_t version = 0;
+
+  *dropped = 0;
+  *listener = -1;
+
+  while ((nfds = recv_msg(conn, &msg, fds, 0)) != -1) {
+    if (msg.kind == HANDOFF_END) {
+      ended = 1;
+      break;
+    }
+    if (msg.kind == HANDOFF_LISTENER && nfds == 1 && *listener == -1) {
+      *listener = fds[0];
+      continue;
+    }
+    if (msg.kind != HANDOFF_SESSION || nfds < 1) {
+      while (nfds--) close(fds[nfds]);
+      continue;
+    }
+    if (!unpack_session(&msg, fds, nfds, clients)) {
+      // Still the old process's client until it hears back from us
+      ERROR_MSG("Could not resume transfer for client %i", msg.address.sin_port);
+      client = *clients;
+      *clients = client->next;
+      client->next = failed;
+      failed = client;
+      (*dropped)++;
+      continue;
+    }
+    taken++;
+  }
+
+  // A version 1 server doesn't wait for an ack; it has already gone
+  version = msg.version;
+  memset(&msg, 0, sizeof(msg));
+  msg.kind = HANDOFF_ACK;
+  msg.taken = taken;
+  msg.dropped = *dropped;
+  if (!ended || *listener == -1 || (version >= 2 && send_msg(conn, &msg, NULL, 0) == -1)) {
+    if (*listener != -1) {
+      close(*listener);
+      *listener = -1;
+    }
+    discard_sessions(clients);
+    discard_sessions(&failed);
+    return -1;
+  }
+
+  for (client = failed; client != NULL; client = client->next) {
+    send_error(ERRCODE_UNKNOWN, "Server restarting.", *client);
+  }
+  discard_sessions(&failed);
+  return taken;
+}
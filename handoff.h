@@ -0,0 +1,62 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+
+#include "defines.h"
+#include "digest.h"
+#include "client.h"
+
+#define HANDOFF_VERSION  2 // 1 had no ack and nothing after name
+#define HANDOFF_TIMEOUT  5 // seconds the old process gets to finish writes in flight
+
+#define HANDOFF_LISTENER 1
+#define HANDOFF_SESSION  2
+#define HANDOFF_END      3
+#define HANDOFF_ACK      4 // back from the new process once it has everything; only then does the old one exit
+
+#define HANDOFF_SOURCE_FILE  0 // file descriptor comes along with the message
+#define HANDOFF_SOURCE_IMAGE 1 // reopen the compressed image by name
+#define HANDOFF_SOURCE_NAME  2 // a finished upstream fetch: reopen the plain file by name
+
+/* One message on the upgrade socket. The session's socket (and file, if any) ride along as
+ * SCM_RIGHTS. Fixed width fields so an upgraded binary can still read it, and new ones only ever
+ * go on the end: a shorter message from an older version just leaves them zeroed */
+struct handoff_msg {
+  uint32_t version;
+  uint32_t kind;
+  uint32_t source;
+  uint32_t request;
+  uint32_t last_block;
+  uint32_t last_amount_written;
+  uint32_t timeouts;
+  uint32_t waiting;
+  int64_t offset;
+  int64_t last_sec, last_usec;
+  struct sockaddr_in address;
+  uint32_t digest_size; // sizeof(struct digest) on the sending side; on mismatch the digest is dropped
+  struct digest digest;
+  char name[TFTP_MAX_REQ_BUF_SIZE];
+  /* Version 2 */
+  uint32_t taken, dropped; // HANDOFF_ACK: how the new process got on
+  uint32_t policy; // PCACHE_* the transfer was opened with
+};
+
+#define HANDOFF_MIN_SIZE offsetof(struct handoff_msg, taken) // what version 1 sent
+
+int handoff_listen(const char *path);
+int handoff_connect(const char *path);
+
+int handoff_send(int conn, int listener, struct clientinfo *clients, int *dropped);
+int handoff_recv(int conn, int *listener, struct clientinfo **clients, int *dropped);
@@ -0,0 +1,423 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#define _GNU_SOURCE // sync_file_range
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "iopool.h"
+#include "pcache.h"
+#include "debug.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static struct ioslot *work_head = NULL, *work_tail = NULL; // waiting for a worker
+static struct ioslot *done = NULL; // finished, waiting for the event loop
+static struct iojob *job_head = NULL, *job_tail = NULL;
+static struct iojob *jobs_done = NULL;
+static int wakefd = -1; // eventfd the workers poke when something finishes
+static struct prefetch *open_files = NULL; // event loop only
+
+static int read_full(int fd, char *buf, int len, off_t offset) {
+  int total = 0;
+  ssize_t rv;
+  while (total < len) {
+    if ((rv = pread(fd, &buf[total], len - total, offset + total)) == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (rv == 0) break;
+    total += rv;
+  }
+  return total;
+}
+
+static int write_full(int fd, const char *buf, int len, off_t offset) {
+  int total = 0;
+  ssize_t rv;
+  while (total < len) {
+    if ((rv = pwrite(fd, &buf[total], len - total, offset + total)) == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    total += rv;
+  }
+  return total;
+}
+
+static void *worker(void *arg) {
+  uint64_t one = 1;
+  struct ioslot *slot;
+  struct iojob *job;
+  int fd, rv;
+
+  while (1) {
+    pthread_mutex_lock(&lock);
+    while (work_head == NULL && job_head == NULL) {
+      pthread_cond_wait(&work_ready, &lock);
+    }
+    if ((job = job_head) != NULL) {
+      if ((job_head = job->next) == NULL) {
+        job_tail = NULL;
+      }
+      pthread_mutex_unlock(&lock);
+
+      job->run(job);
+
+      pthread_mutex_lock(&lock);
+      job->next = jobs_done;
+      jobs_done = job;
+      pthread_mutex_unlock(&lock);
+      if (write(wakefd, &one, sizeof(one)) == -1) {
+        ERROR_MSG("Could not wake event loop: %s", strerror(errno));
+      }
+      continue;
+    }
+    slot = work_head;
+    if ((work_head = slot->next) == NULL) {
+      work_tail = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+
+    fd = slot->owner->fd;
+    if (slot->write) {
+      rv = write_full(fd, slot->data, slot->len, slot->offset);
+      if (rv != -1 && slot->drop && slot->offset >= PCACHE_WRITE_LAG) {
+        // Dirty pages can't be dropped, so wait for the ones a little way back to reach the disk
+        off_t behind = slot->offset - PCACHE_WRITE_LAG;
+        sync_file_range(fd, behind, slot->len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, behind, slot->len, POSIX_FADV_DONTNEED);
+      }
+    }
+    else {
+      // Let the kernel start on what we're likely to ask for next
+      posix_fadvise(fd, slot->offset + PREFETCH_SIZE, PREFETCH_SIZE * (PREFETCH_SLOTS - 1), POSIX_FADV_WILLNEED);
+      if ((rv = read_full(fd, slot->data, PREFETCH_SIZE, slot->offset)) >= 0) {
+        slot->len = rv;
+      }
+      // It's in our buffer now, which is as far back as the client can rewind
+      if (rv > 0 && slot->drop) {
+        posix_fadvise(fd, slot->offset, rv, POSIX_FADV_DONTNEED);
+      }
+    }
+    slot->err = (rv == -1) ? errno : 0;
+
+    pthread_mutex_lock(&lock);
+    slot->next = done;
+    done = slot;
+    pthread_mutex_unlock(&lock);
+
+    if (write(wakefd, &one, sizeof(one)) == -1) {
+      ERROR_MSG("Could not wake event loop: %s", strerror(errno));
+    }
+  }
+  return NULL;
+}
+
+/* Start the worker threads. Returns a descriptor that becomes readable when requests
+ * finish (call iopool_collect then), or -1 */
+int iopool_init(int threads) {
+  int i;
+
+  if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    perror("eventfd");
+    return -1;
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, NULL, worker, NULL)) != 0) {
+      perror("pthread_create");
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+
+  LOG(1, "Started %i disk I/O workers", threads);
+  return wakefd;
+}
+
+static void queue_slot(struct ioslot *slot) {
+  slot->state = SLOT_PENDING;
+  slot->next = NULL;
+  slot->drop = slot->owner->policy == PCACHE_STREAM && slot->owner->sharers == 0;
+  slot->owner->inflight++;
+
+  pthread_mutex_lock(&lock);
+  if (work_tail) work_tail->next = slot; else work_head = slot;
+  work_tail = slot;
+  pthread_cond_signal(&work_ready);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Hand a job to the pool */
+void iopool_submit(struct iojob *job) {
+  job->next = NULL;
+  pthread_mutex_lock(&lock);
+  if (job_tail) job_tail->next = job; else job_head = job;
+  job_tail = job;
+  pthread_cond_signal(&work_ready);
+  pthread_mutex_unlock(&lock);
+}
+
+static void prefetch_free(struct prefetch *io) {
+  close(io->fd);
+  free(io);
+}
+
+/* Hand finished requests back to their clients. Flags each one we heard about with wake */
+void iopool_collect() {
+  struct ioslot *slot, *next;
+  struct iojob *job, *next_job;
+  uint64_t count;
+
+  if (read(wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    ERROR_MSG("Could not read from worker pool: %s", strerror(errno));
+  }
+
+  pthread_mutex_lock(&lock);
+  slot = done;
+  done = NULL;
+  job = jobs_done;
+  jobs_done = NULL;
+  pthread_mutex_unlock(&lock);
+
+  for (; job != NULL; job = next_job) {
+    next_job = job->next;
+    job->finish(job);
+  }
+
+  for (; slot != NULL; slot = next) {
+    struct prefetch *io = slot->owner;
+    next = slot->next;
+
+    io->inflight--;
+    if (slot->write) {
+      if (slot->err && !io->err) {
+        io->err = slot->err;
+      }
+      slot->state = SLOT_EMPTY;
+      slot->len = 0;
+    }
+    else {
+      slot->state = SLOT_READY;
+      if (!slot->err && slot->len < PREFETCH_SIZE) {
+        io->eof = slot->offset + slot->len;
+      }
+    }
+
+    if (!io->orphaned) {
+      io->wake = 1;
+    }
+    else if (io->inflight == 0) {
+      prefetch_free(io);
+    }
+  }
+}
+
+/* Set up buffers for a client reading or writing fd, treating the page cache as policy says */
+struct prefetch * iopool_open(int fd, int write, int policy) {
+  struct prefetch *io, *p;
+  struct stat st;
+  int i;
+
+  if ((io = (struct prefetch*)calloc(1, sizeof(struct prefetch))) == NULL) {
+    return NULL;
+  }
+  if ((io->fd = dup(fd)) == -1) {
+    free(io);
+    return NULL;
+  }
+  io->eof = -1;
+  io->avail = -1;
+  io->policy = policy;
+  if (fstat(io->fd, &st) == 0) {
+    io->dev = st.st_dev;
+    io->ino = st.st_ino;
+    for (p = open_files; p != NULL; p = p->next_open) {
+      if (p->dev == io->dev && p->ino == io->ino) {
+        p->sharers++;
+        io->sharers++;
+      }
+    }
+  }
+  io->next_open = open_files;
+  open_files = io;
+  for (i = 0; i < PREFETCH_SLOTS; i++) {
+    io->slots[i].owner = io;
+    io->slots[i].write = write;
+  }
+
+  if (!write) {
+    posix_fadvise(io->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  if (!write && policy == PCACHE_HOT) {
+    // Small and likely wanted again soon: read it all now, ahead of the client
+    posix_fadvise(io->fd, 0, 0, POSIX_FADV_WILLNEED);
+  }
+  return io;
+}
+
+/* The client is done. Requests still in flight keep the buffers alive until they finish */
+void iopool_close(struct prefetch *io) {
+  struct prefetch **p;
+
+  for (p = &open_files; *p != io; p = &(*p)->next_open);
+  *p = io->next_open;
+  for (p = &open_files; *p != NULL; p = &(*p)->next_open) {
+    if (io->sharers && (*p)->dev == io->dev && (*p)->ino == io->ino) {
+      (*p)->sharers--;
+    }
+  }
+
+  if (io->inflight == 0) {
+    prefetch_free(io);
+  }
+  else {
+    io->orphaned = 1;
+  }
+}
+
+/* Copy up to len bytes at offset out of the prefetched data, and queue reads for the blocks
+ * after it. Only the block before offset is kept behind, since that's as far as a client
+ * ever rewinds. Returns the amount copied, IOPOOL_PENDING if it isn't here yet, or -1 */
+int iopool_read(struct prefetch *io, off_t offset, char *buf, int len) {
+  off_t first = (offset >= len ? offset - len : 0) / PREFETCH_SIZE;
+  off_t current = offset / PREFETCH_SIZE;
+  off_t last = current + PREFETCH_SLOTS - 2;
+  struct ioslot *found = NULL;
+  off_t chunk;
+  int i;
+
+  for (i = 0; i < PREFETCH_SLOTS; i++) {
+    struct ioslot *slot = &io->slots[i];
+    off_t c = slot->offset / PREFETCH_SIZE;
+    if (slot->state == SLOT_READY && (c < first || c > last)) {
+      slot->state = SLOT_EMPTY;
+    }
+    if (slot->state != SLOT_EMPTY && c == current) {
+      found = slot;
+    }
+  }
+
+  // Keep the slots ahead of the client busy
+  for (chunk = current; chunk <= last; chunk++) {
+    struct ioslot *empty = NULL;
+    if (io->eof != -1 && chunk * PREFETCH_SIZE >= io->eof && chunk != current) {
+      break;
+    }
+    // A short read of a file that's still growing would look like its end
+    if (io->avail != -1 && (chunk + 1) * PREFETCH_SIZE > io->avail) {
+      break;
+    }
+    for (i = 0; i < PREFETCH_SLOTS; i++) {
+      if (io->slots[i].state == SLOT_EMPTY) {
+        empty = &io->slots[i];
+      }
+      else if (io->slots[i].offset == chunk * PREFETCH_SIZE) {
+        break;
+      }
+    }
+    if (i == PREFETCH_SLOTS && empty != NULL) {
+      empty->offset = chunk * PREFETCH_SIZE;
+      empty->len = 0;
+      queue_slot(empty);
+      if (chunk == current) {
+        found = empty;
+      }
+    }
+  }
+
+  if (found == NULL || found->state != SLOT_READY) {
+    return IOPOOL_PENDING;
+  }
+  if (found->err) {
+    errno = found->err;
+    return -1;
+  }
+
+  if (offset - found->offset >= found->len) {
+    return 0;
+  }
+  if (len > found->len - (offset - found->offset)) {
+    len = found->len - (offset - found->offset);
+  }
+  memcpy(buf, &found->data[offset - found->offset], len);
+  return len;
+}
+
+/* Make sure there's room to buffer the next block. Returns 0 if there is, IOPOOL_PENDING
+ * if we have to wait for a write to finish first, or -1 if an earlier write failed */
+int iopool_reserve(struct prefetch *io) {
+  int i;
+
+  if (io->err) {
+    errno = io->err;
+    return -1;
+  }
+  if (io->fill != NULL) {
+    return 0;
+  }
+  for (i = 0; i < PREFETCH_SLOTS; i++) {
+    if (io->slots[i].state == SLOT_EMPTY) {
+      io->fill = &io->slots[i];
+      io->fill->len = 0;
+      return 0;
+    }
+  }
+  return IOPOOL_PENDING;
+}
+
+/* Buffer len bytes to be written at offset, which must follow on from the last write.
+ * The caller has to have reserved room first. Returns 0, or -1 if a write failed */
+int iopool_write(struct prefetch *io, off_t offset, const char *data, int len) {
+  struct ioslot *slot;
+  int rv;
+
+  if ((rv = iopool_reserve(io)) != 0) {
+    if (rv == IOPOOL_PENDING) {
+      errno = EAGAIN;
+    }
+    return -1;
+  }
+
+  slot = io->fill;
+  if (slot->len == 0) {
+    slot->offset = offset;
+  }
+  memcpy(&slot->data[slot->len], data, len);
+  slot->len += len;
+
+  if (slot->len == PREFETCH_SIZE) {
+    io->fill = NULL;
+    queue_slot(slot);
+  }
+  return 0;
+}
+
+/* Start writing whatever is buffered. Returns 0 once everything is on disk,
+ * IOPOOL_PENDING while writes are in flight, or -1 if any of them failed */
+int iopool_flush(struct prefetch *io) {
+  if (io->fill != NULL && io->fill->len > 0) {
+    queue_slot(io->fill);
+    io->fill = NULL;
+  }
+  if (io->err) {
+    errno = io->err;
+    return -1;
+  }
+  return io->inflight ? IOPOOL_PENDING : 0;
+}
@@ -0,0 +1,74 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+#include <sys/types.h>
+
+#define IOPOOL_THREADS  4
+#define PREFETCH_SLOTS  4
+#define PREFETCH_SIZE   16384 // bytes per disk request; a multiple of TFTP_MAX_BUF_SIZE
+
+#define IOPOOL_PENDING  -2 // the disk hasn't caught up yet; try again when the pool wakes us
+
+#define SLOT_EMPTY   0
+#define SLOT_PENDING 1 // queued for, or being handled by, a worker
+#define SLOT_READY   2
+
+/* One disk request's worth of file data */
+struct ioslot {
+  struct prefetch *owner;
+  int state;
+  int write; // 1 to write data out, 0 to read it in
+  off_t offset;
+  int len; // bytes read (short at EOF) or waiting to be written
+  int err; // errno from the worker, 0 on success
+  int drop; // drop these pages from the page cache once they're through
+  char data[PREFETCH_SIZE];
+  struct ioslot *next; // work/completion queue
+};
+
+/* Per-client buffers for the worker pool. Reads are prefetched ahead of the client;
+ * writes are collected into slots and flushed behind it */
+struct prefetch {
+  int fd; // our own descriptor, so it outlives the client's FILE
+  int policy; // PCACHE_* for how the workers treat the page cache
+  dev_t dev; // which file fd is, to spot other transfers of it
+  ino_t ino;
+  unsigned sharers; // other transfers with the same file open; it's left in the cache while there are any
+  struct prefetch *next_open; // every client's buffers, until the client is done
+  unsigned inflight; // slots queued or being worked on
+  int orphaned; // the client is gone; free once inflight reaches 0
+  int wake; // a request finished since the event loop last looked
+  int err; // first write error, reported on the next packet
+  off_t eof; // file size once a short read has told us, else -1
+  off_t avail; // for a file still being written: bytes it's safe to read so far, else -1
+  struct ioslot *fill; // write slot being filled
+  struct ioslot slots[PREFETCH_SLOTS];
+};
+
+/* Any other work for the pool: run() is called on a worker thread, then finish() back on the
+ * event loop from iopool_collect. Embed this in a struct of your own */
+struct iojob {
+  void (*run)(struct iojob *job);
+  void (*finish)(struct iojob *job);
+  struct iojob *next;
+};
+
+int iopool_init(int threads);
+void iopool_submit(struct iojob *job);
+void iopool_collect();
+
+struct prefetch * iopool_open(int fd, int write, int policy);
+void iopool_close(struct prefetch *io);
+
+int iopool_read(struct prefetch *io, off_t offset, char *buf, int len);
+int iopool_reserve(struct prefetch *io);
+int iopool_write(struct prefetch *io, off_t offset, const char *data, int len);
+int iopool_flush(struct prefetch *io);
@@ -23,10 +23,18 @@
 #include "debug.h"
 #include "client.h"
 #include "packet.h"
+#include "digest.h"
+#include "cimage.h"
+#include "iopool.h"
+#include "proxy.h"
+#include "admit.h"
+#include "handoff.h"
+#include "pcache.h"
 
 #include "defines.h"
+#include "probes.h"
 
-int get_local_addr() {
+int get_local_addr(const char *port) {
   struct addrinfo hints, *ai, *p;
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;
@@ -34,7 +42,7 @@ int get_local_addr() {
   hints.ai_flags = AI_PASSIVE;
 
   int rv;
-  if ((rv = getaddrinfo(NULL, TFTP_PORT, &hints, &ai)) != 0) {
+  if ((rv = getaddrinfo(NULL, port, &hints, &ai)) != 0) {
     ERROR_MSG("tftpserver: %s", gai_strerror(rv));
     return -1;
   }
@@ -58,32 +66,214 @@ int get_local_addr() {
   return -1;
 }
 
+/* Answer clients the worker pool or an upstream fetch has flagged as ready to continue */
+void resume_clients(struct clientinfo **clients, fd_set *master, struct timeval *curtime) {
+  struct clientinfo *p;
+  for (p = *clients; p != NULL; ) {
+    if ((p->io != NULL && p->io->wake) || (p->fetch != NULL && p->fetch->progress) ||
+        (p->image != NULL && p->image->progress)) {
+      int rv;
+      if (p->io != NULL) {
+        p->io->wake = 0;
+      }
+      rv = resume_client(p);
+      if (rv == RETURN_ERR || rv == RETURN_CLOSECONN) {
+        close_client_connection(p, master);
+        p = delete_client(p, clients);
+        continue;
+      }
+      if (rv == RETURN_STD) {
+        p->last_time = *curtime;
+      }
+    }
+    p = p->next;
+  }
+}
+
+/* Let writes in flight reach the disk before their sessions move to another process */
+void drain_writes(int wakefd, struct clientinfo *clients) {
+  struct timeval start, now;
+  gettimeofday(&start, NULL);
+
+  do {
+    struct clientinfo *p;
+    struct timeval tv = { 0, 100000 };
+    fd_set fds;
+    int busy = 0;
+
+    for (p = clients; p != NULL; p = p->next) {
+      if (p->request == OP_WRQ && p->io != NULL) {
+        iopool_flush(p->io);
+        busy |= p->io->inflight != 0;
+      }
+    }
+    if (!busy) {
+      return;
+    }
+
+    FD_ZERO(&fds);
+    FD_SET(wakefd, &fds);
+    if (select(wakefd + 1, &fds, NULL, NULL, &tv) > 0) {
+      iopool_collect();
+    }
+    gettimeofday(&now, NULL);
+  } while (now.tv_sec - start.tv_sec < HANDOFF_TIMEOUT);
+}
+
+void usage(char *prog) {
+  fprintf(stderr, "Usage: %s [-p port] [-s] [-c cache_mb] [-w workers] [-u upstream[:port]] [-r rate] [-f] [-H path]\n"
+                  "       [-L large_mb] [-P pattern]...\n", prog);
+  fprintf(stderr, "  -p  port to listen on (default %s)\n", TFTP_PORT);
+  fprintf(stderr, "  -s  also compute a SHA-256 digest of each transfer (CRC32C is always computed)\n");
+  fprintf(stderr, "  -c  memory budget for decompressed chunks of %s images, in MiB (default %i)\n",
+          CIMAGE_SUFFIX, CIMAGE_DEFAULT_BUDGET >> 20);
+  fprintf(stderr, "  -w  number of disk I/O worker threads (default %i)\n", IOPOOL_THREADS);
+  fprintf(stderr, "  -u  fetch missing files from this TFTP server and keep a copy\n");
+  fprintf(stderr, "  -r  new transfers per second allowed from one address, 0 for no limit (default %i)\n", ADMIT_RATE);
+  fprintf(stderr, "  -f  drop packets that aren't requests in the kernel, before they reach the listener\n");
+  fprintf(stderr, "  -H  upgrade socket: take over sessions from a server already listening there, and\n"
+                  "      hand ours to the next one started with the same path\n");
+  fprintf(stderr, "  -L  files this big or bigger are dropped from the page cache behind the client, unless\n"
+                  "      they were cached already or another transfer has them open; smaller ones are read\n"
+                  "      in whole as soon as they're requested\n");
+  fprintf(stderr, "  -P  also treat downloads and uploads whose names match this pattern as large\n");
+}
 
 int main(int argc, char **argv) {
   fd_set master;
   fd_set read_fds;
 
-  int listener;
+  int listener = -1;
+  int wakefd;
+  int upgradefd = -1;
+  char *upgrade_path = NULL;
+  int workers = IOPOOL_THREADS;
+  int kernel_filter = 0;
+  char *port = TFTP_PORT;
 
   char buf[TFTP_STD_HEADER_SIZE + TFTP_MAX_BUF_SIZE + 1]; // add 1 character to ensure we're null-escaped
 
   struct clientinfo *clients = NULL;
 
+  int opt;
+  while ((opt = getopt(argc, argv, "p:sc:w:u:r:fH:L:P:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = optarg;
+        break;
+      case 's':
+        digest_set_sha256(1);
+        break;
+      case 'c':
+        cimage_set_budget((size_t)atoi(optarg) << 20);
+        break;
+      case 'w':
+        // Every transfer waits on the pool, so it can't be empty
+        if ((workers = atoi(optarg)) < 1) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'u':
+        if (proxy_set_upstream(optarg) == -1) {
+          return 1;
+        }
+        break;
+      case 'r':
+        admit_set_rate(atoi(optarg));
+        break;
+      case 'f':
+        kernel_filter = 1;
+        break;
+      case 'H':
+        upgrade_path = optarg;
+        break;
+      case 'L':
+        pcache_set_threshold((off_t)atoi(optarg) << 20);
+        break;
+      case 'P':
+        if (pcache_add_pattern(optarg) == -1) {
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
   FD_ZERO(&master);
   FD_ZERO(&read_fds);
 
-  if ((listener = get_local_addr()) == -1) {
+  if ((wakefd = iopool_init(workers)) == -1) {
+    return 3;
+  }
+
+  /* Upgrading a running server: it passes us its listener and transfers and exits */
+  int conn;
+  if (upgrade_path != NULL && (conn = handoff_connect(upgrade_path)) != -1) {
+    struct timeval start, done;
+    struct clientinfo *p;
+    int taken, dropped;
+
+    gettimeofday(&start, NULL);
+    taken = handoff_recv(conn, &listener, &clients, &dropped);
+    close(conn);
+    if (taken == -1) {
+      // The old server keeps everything, and the port along with it
+      ERROR_MSG("Could not take over from the old server");
+    }
+
+    // Anyone the old server left waiting on the disk gets answered as soon as our reads land
+    for (p = clients; p != NULL; p = p->next) {
+      FD_SET(p->sockfd, &master);
+      if (p->waiting && p->io != NULL) {
+        p->io->wake = 1;
+      }
+      if (p->waiting && p->image != NULL) {
+        p->image->progress = 1;
+      }
+    }
+    resume_clients(&clients, &master, &start);
+    cimage_reap();
+
+    gettimeofday(&done, NULL);
+    if (taken != -1) {
+      LOG(1, "Took over from the old server in %li us: %i transfers resumed, %i dropped",
+          (done.tv_sec - start.tv_sec) * 1000000 + done.tv_usec - start.tv_usec, taken, dropped);
+    }
+  }
+
+  if (listener == -1 && (listener = get_local_addr(port)) == -1) {
+    return 3;
+  }
+
+  if (kernel_filter && admit_attach_filter(listener) == -1) {
+    return 3;
+  }
+
+  if (upgrade_path != NULL && (upgradefd = handoff_listen(upgrade_path)) == -1) {
     return 3;
   }
 
   FD_SET(listener, &master);
-  int fdmax = listener;
+  FD_SET(wakefd, &master);
+  if (upgradefd != -1) {
+    FD_SET(upgradefd, &master);
+  }
+  int fd, fdmax = 0;
+  for (fd = 0; fd < FD_SETSIZE; fd++) {
+    if (FD_ISSET(fd, &master)) {
+      fdmax = fd;
+    }
+  }
 
-  LOG(1, "TFTP Server bound to port %s. Listening for a connection.", TFTP_PORT);
+  LOG(1, "TFTP Server bound to port %s. Listening for a connection.", port);
 
   while (1) {
     struct timeval tv, curtime;
     int num_fresh_fds;
+    int selectmax;
     int len_data;
     struct sockaddr addrin;
     socklen_t sock_len = sizeof(struct sockaddr_in);
@@ -91,7 +281,10 @@ int main(int argc, char **argv) {
     tv.tv_usec = 0;
 
     read_fds = master;
-    if ((num_fresh_fds = select(fdmax+1, &read_fds, NULL, NULL, &tv)) == -1) {
+    if ((selectmax = proxy_fdset(&read_fds)) < fdmax) {
+      selectmax = fdmax;
+    }
+    if ((num_fresh_fds = select(selectmax+1, &read_fds, NULL, NULL, &tv)) == -1) {
       /* Restart on signal */
       if (errno == EINTR) {
         continue;
@@ -105,15 +298,64 @@ int main(int argc, char **argv) {
     /* Get time select returned, for timeouts */
     gettimeofday(&curtime, NULL);
 
-    /* Check if our master is set */
-    if (FD_ISSET(listener, &read_fds)) {
+    /* Carry on with clients whose disk I/O has finished or whose upstream fetch moved along */
+    int woken = proxy_poll(&read_fds, &curtime);
+    if (FD_ISSET(wakefd, &read_fds)) {
+      iopool_collect();
+      woken = 1;
+    }
+    if (woken) {
+      resume_clients(&clients, &master, &curtime);
+      proxy_reap();
+      cimage_reap();
+    }
+
+    /* A new server wants to take over. Once it has our sessions we're done */
+    if (upgradefd != -1 && FD_ISSET(upgradefd, &read_fds)) {
+      int conn, sent, dropped;
+      if ((conn = accept(upgradefd, NULL, NULL)) != -1) {
+        LOG(1, "Handing off to a new server");
+        drain_writes(wakefd, clients);
+        if ((sent = handoff_send(conn, listener, clients, &dropped)) != -1) {
+          LOG(1, "Handed off %i transfers (%i dropped). Exiting.", sent, dropped);
+          return 0;
+        }
+        ERROR_MSG("Handoff failed; carrying on");
+        close(conn);
+      }
+    }
+
+    /* Check if our master is set. Take a batch of requests at a time so a flood of junk can't
+     * starve real ones of their turn */
+    int batch;
+    for (batch = 0; FD_ISSET(listener, &read_fds) && batch < ADMIT_BATCH; batch++) {
       struct clientinfo *client;
+      int errcode;
+      char *errmsg;
 
       LOG(3, "Establishing a new connection");
 
-      if ((len_data = recvfrom(listener, buf, TFTP_STD_HEADER_SIZE + TFTP_MAX_BUF_SIZE, 0, &addrin, &sock_len)) == -1) {
-        perror("recvfrom");
-        continue;
+      sock_len = sizeof(struct sockaddr_in);
+      if ((len_data = recvfrom(listener, buf, TFTP_STD_HEADER_SIZE + TFTP_MAX_BUF_SIZE, MSG_DONTWAIT, &addrin, &sock_len)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("recvfrom");
+        }
+        break;
+      }
+
+      // Decide whether it's worth a socket before we make one
+      switch (admit_packet(buf, len_data, (struct sockaddr_in*)&addrin, &curtime, &errcode, &errmsg)) {
+        case ADMIT_DROP:
+          continue;
+        case ADMIT_REJECT: {
+          // Answer from the listener, the way we do for a bad TID
+          struct clientinfo rejected;
+          rejected.address = *(struct sockaddr_in*)&addrin;
+          rejected.len = sock_len;
+          rejected.sockfd = listener;
+          send_error(errcode, errmsg, rejected);
+          continue;
+        }
       }
 
       // Establish ephemeral connection with client
@@ -125,7 +367,9 @@ int main(int argc, char **argv) {
       client = new_client( new_fd, (struct sockaddr_in*)&addrin, sock_len, &clients);
 
       FD_SET(new_fd, &master);
-      fdmax = new_fd;
+      if (new_fd > fdmax) {
+        fdmax = new_fd;
+      }
 
       LOG(1, "Bound to new client on fd %i with tid %i", new_fd, client->address.sin_port);
       handle_client(client, &curtime, buf, len_data, &clients, &master);
@@ -145,7 +389,9 @@ int main(int argc, char **argv) {
         if (addrin.sin_port != p->address.sin_port) {
           // Construct a temporary client so we can give it the bad news about being unauthorized
           struct clientinfo new_client;
+          PROBE(tid_reject, client_get_tid(*p), addrin.sin_port);
           new_client.address = addrin;
+          new_client.len = sock_len;
           new_client.sockfd = p->sockfd;
           send_error(ERRCODE_TID, "Unknown transfer ID.", new_client);
           continue;
@@ -166,9 +412,11 @@ int main(int argc, char **argv) {
             delete_client(p, &clients);
             continue;
           }
-          if (p->request == OP_RRQ) {
+          // Nothing to resend if we're still waiting on the disk for it
+          if (p->request == OP_RRQ && !p->waiting) {
             int rv;
             LOG(1, "Client %i timed out. Attempting to resend block.", p->address.sin_port);
+            PROBE(retransmit, client_get_tid(*p), p->last_block, p->timeouts);
             rewind_client_file(p);
             rv = send_data(p);
             if (rv == RETURN_ERR || rv == RETURN_CLOSECONN) { 
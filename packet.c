@@ -9,9 +9,11 @@
 
 #include "packet.h"
 #include "client.h"
+#include "pcache.h"
 
 #include "debug.h"
 #include "defines.h"
+#include "probes.h"
 
 #include <libgen.h>
 
@@ -79,7 +81,7 @@ int handle_packet(char *buf, int pack_size, struct clientinfo *client) {
     return RETURN_ERR;
   }
 
-  buf[pack_size + 1] = '\0'; // buffer is 1 byte larger than max recv amount. here we avoid overflows in printf/etc
+  buf[pack_size] = '\0'; // buffer is 1 byte larger than max recv amount. here we avoid overflows in printf/etc
 
   // Determine which operation we're using
   op = get_op(buf);
@@ -129,6 +131,13 @@ int handle_request(char *buf, char *path, int pack_size, struct clientinfo *clie
 
   strip_path(path, &buf[TFTP_REQ_HEADER_SIZE]);
 
+  // Where an upstream fetch is written until it's complete; never ours to serve or overwrite
+  if (strncmp(path, PROXY_PART_PREFIX, strlen(PROXY_PART_PREFIX)) == 0) {
+    send_error(ERRCODE_ACCESS, "Access violation.", *client);
+    ERROR_MSG("Refusing request for partial file '%s'", path);
+    return RETURN_ERR;
+  }
+
   /* Get the mode by looking at the string after the filename */
   mode = &buf[TFTP_REQ_HEADER_SIZE + filename_len + 1];
   int mode_len = strnlen(mode, TFTP_MAX_REQ_BUF_SIZE - filename_len - 1);
@@ -147,6 +156,7 @@ int handle_request(char *buf, char *path, int pack_size, struct clientinfo *clie
   }
 
   LOG(2, "File specified: '%s', using mode: %s", path, mode);
+  PROBE(request, client_get_tid(*client), get_op(buf), path);
 
   return RETURN_STD;
 }
@@ -163,9 +173,24 @@ int handle_rrq(char *buf, int pack_size, struct clientinfo *client) {
 
   LOG(1, "Opening file '%s' for reading", path);
 
+  client->file = fopen(path, "rb");
+
+  /* Fall back to a compressed copy of the image if there is one. If there's a copy we can't
+   * open, errno says why rather than ENOENT, so we neither report it missing nor fetch it */
+  if (client->file == NULL && errno == ENOENT) {
+    client->image = cimage_open(path);
+  }
+
+  /* Still nothing here: get it from the upstream while we serve it */
+  if (client->file == NULL && client->image == NULL && errno == ENOENT && proxy_enabled()) {
+    client->fetch = proxy_fetch(path);
+  }
+
   /* Handle error cases with fopen */
-  if ((client->file = fopen(path, "rb")) == NULL) {
+  if (client->file == NULL && client->image == NULL && client->fetch == NULL) {
+    int err = errno;
     perror("Error opening file");
+    errno = err; // writing to stderr can clobber it
     if (errno == EACCES) {
       send_error(ERRCODE_ACCESS, "Access violation.", *client);
       return RETURN_ERR;
@@ -183,6 +208,25 @@ int handle_rrq(char *buf, int pack_size, struct clientinfo *client) {
     return RETURN_ERR;
   }
 
+  // Digests are recorded against the file on disk, which a compressed image doesn't match
+  if (client->file != NULL) {
+    if ((client->io = iopool_open(fileno(client->file), 0, pcache_policy(path, fileno(client->file), 0))) == NULL) {
+      perror("Could not set up file buffers");
+      send_error(ERRCODE_DISK, "Cannot allocate space for the file", *client);
+      return RETURN_ERR;
+    }
+    digest_init(&client->digest);
+    digest_load(&client->digest, fileno(client->file));
+  }
+  // Fetched data is read back off disk by the workers too, as it arrives
+  else if (client->fetch != NULL && (client->io = iopool_open(client->fetch->fd, 0, PCACHE_DEFAULT)) == NULL) {
+    perror("Could not set up file buffers");
+    send_error(ERRCODE_DISK, "Cannot allocate space for the file", *client);
+    return RETURN_ERR;
+  }
+
+  PROBE(file_open, client_get_tid(*client), path,
+        client->image ? PROBE_SOURCE_IMAGE : client->fetch ? PROBE_SOURCE_UPSTREAM : PROBE_SOURCE_FILE);
   LOG(2, "Opened file. Sending initial packet");
 
   return send_data(client);
@@ -193,7 +237,7 @@ int handle_rrq(char *buf, int pack_size, struct clientinfo *client) {
 int handle_wrq(char *buf, int pack_size, struct clientinfo *client) {
   char path[TFTP_MAX_REQ_BUF_SIZE];
 
-  if (!handle_request(buf, path, pack_size, client) == RETURN_ERR) {
+  if (handle_request(buf, path, pack_size, client) == RETURN_ERR) {
     return RETURN_ERR;
   }
 
@@ -225,6 +269,15 @@ int handle_wrq(char *buf, int pack_size, struct clientinfo *client) {
     return RETURN_ERR;
   }
 
+  if ((client->io = iopool_open(fd, 1, pcache_policy(path, fd, 1))) == NULL) {
+    perror("Could not set up file buffers");
+    send_error(ERRCODE_DISK, "Cannot create file", *client);
+    return RETURN_ERR;
+  }
+
+  digest_init(&client->digest);
+  PROBE(file_open, client_get_tid(*client), path, PROBE_SOURCE_NEW);
+
   // Ready for data!
   return send_ack(0, *client);
 }
@@ -241,12 +294,17 @@ int handle_data(char *buf, int pack_size, struct clientinfo *client) {
   block = get_block(buf);
 
   LOG(2, "Got packet %i with size %i", block, buf_size);
+  PROBE(data_recv, client_get_tid(*client), block, buf_size);
 
   // If we get an invalid block, we might have had a timeout. The client sending the data needs to be acknowledged,
   // even if the data is to be ignored. Otherwise it will not continue sending data.
   // If there are more than UINT_MAX packets, the client seems to expect integer wrapping
   unsigned next_block = client_get_next_block(client);
   if (next_block != block) {
+    // We're holding back the ack for the last block until the disk catches up; it's coming
+    if (client->waiting) {
+      return RETURN_IGNORE;
+    }
     ERROR_MSG("(client %i) Got unexpected block #%i (expected #%i), acknowledging and discarding", client_get_tid(*client), block, next_block);
     if (send_ack(block, *client) == RETURN_ERR) {
       return RETURN_ERR;
@@ -254,31 +312,70 @@ int handle_data(char *buf, int pack_size, struct clientinfo *client) {
     return RETURN_IGNORE;
   }
 
-  /* Only actually write if the packet has data */
+  /* Only actually write if the packet has data. The worker pool writes it out behind us */
   if (buf_size) {
-    if (fwrite(get_datablock(buf), 1, buf_size, client->file) != buf_size) {
-      if (ferror(client->file) != 0) {
-        perror("error writing to file");
-        send_error(ERRCODE_UNKNOWN, strerror(errno), *client);
-        return RETURN_ERR;
-      }
+    if (iopool_write(client->io, client->offset, get_datablock(buf), buf_size) == -1) {
+      perror("error writing to file");
+      send_error(ERRCODE_UNKNOWN, strerror(errno), *client);
+      return RETURN_ERR;
     }
-    LOG(2, "Wrote %i bytes.", buf_size);
+    digest_update_at(&client->digest, client->offset, get_datablock(buf), buf_size);
+    client->offset += buf_size;
+    LOG(2, "Buffered %i bytes.", buf_size);
   }
 
-  if (send_ack(block, *client) == RETURN_ERR) {
+  client_update_block(buf_size, client);
+
+  client->waiting = 1;
+  return finish_write(client);
+}
+
+/* Acknowledge the block we just took, once there's room to buffer the next one. After the
+ * last block, wait until everything is on disk so a write error still reaches the client */
+int finish_write(struct clientinfo *client) {
+  int last = client->last_amount_written < TFTP_MAX_BUF_SIZE;
+  int rv;
+
+  rv = last ? iopool_flush(client->io) : iopool_reserve(client->io);
+  if (rv == IOPOOL_PENDING) {
+    LOG(2, "Waiting on disk before acknowledging block #%i", client->last_block);
+    PROBE(io_wait, client_get_tid(*client), client->last_block);
+    return RETURN_PENDING;
+  }
+  if (rv == -1) {
+    perror("error writing to file");
+    send_error(ERRCODE_UNKNOWN, strerror(errno), *client);
     return RETURN_ERR;
   }
+  client->waiting = 0;
 
-  client_update_block(buf_size, client);
+  if (last) {
+    digest_store(&client->digest, fileno(client->file));
+  }
 
-  if (buf_size < TFTP_MAX_BUF_SIZE) {
+  if (send_ack(client->last_block, *client) == RETURN_ERR) {
+    return RETURN_ERR;
+  }
+
+  if (last) {
     LOG(1, "Packet smaller than max size. Closing connection");
     return RETURN_CLOSECONN;
   }
   return RETURN_STD;
 }
 
+/* Pick up where we left off when the disk I/O a client was waiting on has finished */
+int resume_client(struct clientinfo *client) {
+  if (!client->waiting) {
+    return RETURN_IGNORE;
+  }
+  PROBE(io_resume, client_get_tid(*client), client->last_block);
+  if (client->request == OP_RRQ) {
+    return send_data(client);
+  }
+  return finish_write(client);
+}
+
 
 /* Handle an Acknowledgement packet */
 int handle_ack(char *buf, int pack_size, struct clientinfo *client) {
@@ -287,6 +384,7 @@ int handle_ack(char *buf, int pack_size, struct clientinfo *client) {
   }
 
   int block = get_block(buf);
+  PROBE(ack_recv, client_get_tid(*client), block);
   if (client->last_block != block) {
     // If we're sending the data, we are required to ignore any invalid acks to avoid SAS
     ERROR_MSG("(client %i) Got invalid block id %i, ignoring", client_get_tid(*client), block);
@@ -337,6 +435,7 @@ int send_ack(int block, const struct clientinfo client) {
   set_block(buf, block);
 
   LOG(2, "Acknowledging block #%i", block);
+  PROBE(ack_send, client_get_tid(client), block);
 
   if (sendto_client(buf, TFTP_STD_HEADER_SIZE, client) == -1) {
     return RETURN_ERR;
@@ -345,21 +444,60 @@ int send_ack(int block, const struct clientinfo client) {
 }
 
 
+/* Read the next block for the client from its compressed image, upstream fetch or prefetched file data.
+ * pos is set to the block's offset. Returns the amount read, IOPOOL_PENDING or -1 on error */
+static int read_block(struct clientinfo *client, char *buf, long *pos) {
+  int size;
+
+  *pos = client->offset;
+  if (client->image != NULL) {
+    size = cimage_read(client->image, client->offset, buf, TFTP_MAX_BUF_SIZE);
+  }
+  else if (client->fetch != NULL) {
+    size = proxy_read(client->fetch, client->io, client->offset, buf, TFTP_MAX_BUF_SIZE);
+  }
+  else {
+    size = iopool_read(client->io, client->offset, buf, TFTP_MAX_BUF_SIZE);
+  }
+
+  if (size > 0) {
+    client->offset += size;
+  }
+  return size;
+}
+
 /* Send a data packet to the client */
 int send_data(struct clientinfo *client) {
   char buf[TFTP_MAX_BUF_SIZE + TFTP_STD_HEADER_SIZE];
   int size;
+  long pos; // where this block starts, for the digest
 
   LOG(2, "Sending data block #%i", client->last_block + 1);
   set_op(buf, OP_DATA);
   set_block(buf, client->last_block + 1);
 
-  if ((size = fread(get_datablock(buf), 1, TFTP_MAX_BUF_SIZE, client->file)) < TFTP_MAX_BUF_SIZE) {
-    if (ferror(client->file) != 0) {
-      perror("Error reading file");
+  if ((size = read_block(client, get_datablock(buf), &pos)) == IOPOOL_PENDING) {
+    LOG(2, "Block #%i not read in yet, waiting", client->last_block + 1);
+    PROBE(io_wait, client_get_tid(*client), client->last_block + 1);
+    client->waiting = 1;
+    return RETURN_PENDING;
+  }
+  if (size == -1) {
+    perror("Error reading file");
+    // The upstream may only tell us the file doesn't exist once we've started
+    if (errno == ENOENT) {
+      send_error(ERRCODE_NOTFOUND, "File not found.", *client);
+    }
+    else {
       send_error(ERRCODE_UNKNOWN, strerror(errno), *client);
-      return RETURN_ERR;
     }
+    return RETURN_ERR;
+  }
+  client->waiting = 0;
+
+  digest_update_at(&client->digest, pos, get_datablock(buf), size);
+  if (size < TFTP_MAX_BUF_SIZE && client->file != NULL) {
+    digest_store(&client->digest, fileno(client->file));
   }
 
   LOG(2,"Sending buf with size %i to client %i", size, client_get_tid(*client));
@@ -367,6 +505,7 @@ int send_data(struct clientinfo *client) {
   if (sendto_client(buf, size + TFTP_STD_HEADER_SIZE, *client) == -1) {
     return RETURN_ERR;
   }
+  PROBE(data_send, client_get_tid(*client), client->last_block + 1, size);
 
   client_update_block(size, client);
 
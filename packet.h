@@ -15,10 +15,11 @@
 #include <fcntl.h>
 
 #include "client.h"
+#include "iopool.h"
 
-const char* opcodes[5];
+extern const char* opcodes[5];
 
-int (*op_handlers[5])(char *buf, int pack_size, struct clientinfo *client);
+extern int (*op_handlers[5])(char *buf, int pack_size, struct clientinfo *client);
 
 int handle_packet(char *buf, int pack_size, struct clientinfo *client);
 
@@ -30,6 +31,9 @@ int handle_data(char *buf, int pack_size, struct clientinfo *client);
 int handle_ack(char *buf, int pack_size, struct clientinfo *client);
 int handle_error(char *buf, int pack_size, struct clientinfo *client);
 
+int finish_write(struct clientinfo *client);
+int resume_client(struct clientinfo *client);
+
 int require_connection(const struct clientinfo client, int type);
 
 int send_ack(int block, const struct clientinfo client);
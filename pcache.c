@@ -0,0 +1,135 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "pcache.h"
+#include "debug.h"
+
+static off_t threshold = 0;
+static const char *patterns[PCACHE_MAX_PATTERNS];
+static int npatterns = 0;
+
+static long long total_bytes[3], cached_bytes[3];
+
+/* Files at least this big are streamed, smaller ones kept hot. 0 turns size-based policy off */
+void pcache_set_threshold(off_t bytes) {
+  threshold = bytes;
+}
+
+/* Stream files whose names match pattern (fnmatch syntax), whatever their size */
+int pcache_add_pattern(const char *pattern) {
+  if (npatterns == PCACHE_MAX_PATTERNS) {
+    ERROR_MSG("At most %i streaming patterns", PCACHE_MAX_PATTERNS);
+    return -1;
+  }
+  patterns[npatterns++] = pattern;
+  return 0;
+}
+
+/* Roughly how much of the first size bytes of fd is in the page cache right now, or -1. Small
+ * files are looked at whole; for bigger ones a few samples will do, so checking a multi-gigabyte
+ * file costs no more than a small one */
+static long long resident_bytes(int fd, off_t size) {
+  static unsigned char vec[PCACHE_SAMPLES * PCACHE_SAMPLE_SIZE / 4096];
+  long page = sysconf(_SC_PAGESIZE);
+  long long resident = 0, sampled = 0;
+  off_t len = size, stride = 0;
+  int samples = 1, i;
+  long j;
+  void *map;
+
+  if (size > PCACHE_SAMPLES * PCACHE_SAMPLE_SIZE) {
+    samples = PCACHE_SAMPLES;
+    len = PCACHE_SAMPLE_SIZE;
+    stride = (size - len) / (samples - 1);
+  }
+
+  // Mapping doesn't read anything in; mincore just reports on what's there
+  if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    return -1;
+  }
+  for (i = 0; i < samples; i++) {
+    off_t off = i * stride / page * page;
+    if (mincore((char*)map + off, len, vec) == 0) {
+      for (j = 0; j < (len + page - 1) / page; j++) {
+        resident += vec[j] & 1;
+      }
+      sampled += (len + page - 1) / page;
+    }
+  }
+  munmap(map, size);
+
+  if (sampled == 0) {
+    return -1;
+  }
+  return resident == sampled ? size : resident * size / sampled;
+}
+
+/* Since Linux 5.0, mincore on a file we neither own nor could write reports every page as
+ * resident, whatever the truth. The answer is only worth acting on when it would be real */
+static int mincore_honest(const char *name, const struct stat *st) {
+  return geteuid() == 0 || st->st_uid == geteuid() || faccessat(AT_FDCWD, name, W_OK, AT_EACCESS) == 0;
+}
+
+/* Record how much of a file being read was already cached when the transfer started */
+static void account(int policy, off_t size, long long resident) {
+  total_bytes[policy] += size;
+  cached_bytes[policy] += resident;
+
+  LOG(1, "Page cache held %lli%% of this file, %lli%% of the %lli bytes of %s files requested so far",
+      resident * 100 / size, cached_bytes[policy] * 100 / total_bytes[policy], total_bytes[policy],
+      policy == PCACHE_HOT ? "hot" : policy == PCACHE_STREAM ? "streamed" : "default");
+}
+
+/* Decide how a transfer of name (open on fd) should treat the page cache, and for reads under a
+ * policy, note how much of the file the cache already has. Uploads start out empty, so only a pattern can mark them */
+int pcache_policy(const char *name, int fd, int write) {
+  struct stat st;
+  long long resident;
+  int policy = PCACHE_DEFAULT;
+  int i;
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return PCACHE_DEFAULT;
+  }
+
+  for (i = 0; i < npatterns; i++) {
+    if (fnmatch(patterns[i], name, 0) == 0) {
+      policy = PCACHE_STREAM;
+      break;
+    }
+  }
+  if (policy == PCACHE_DEFAULT && threshold != 0 && !write) {
+    policy = st.st_size >= threshold ? PCACHE_STREAM : PCACHE_HOT;
+  }
+
+  // Only worth the mmap when someone has asked us to manage the cache
+  if (write || (!threshold && !npatterns) || st.st_size == 0) {
+    return policy;
+  }
+  if (!mincore_honest(name, &st)) {
+    LOG(1, "Can't tell how much of %s is in the page cache", name);
+    return policy;
+  }
+  if ((resident = resident_bytes(fd, st.st_size)) != -1) {
+    account(policy, st.st_size, resident);
+    if (policy == PCACHE_STREAM && resident * 2 >= st.st_size) {
+      // Mostly cached already, so somebody else is using it: dropping it behind us would cost them
+      LOG(1, "%s is already in the page cache; leaving it there", name);
+      policy = PCACHE_DEFAULT;
+    }
+  }
+  return policy;
+}
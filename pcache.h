@@ -0,0 +1,26 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+#include <sys/types.h>
+
+#define PCACHE_DEFAULT  0 // leave it all to the kernel
+#define PCACHE_HOT      1 // small file: pull the whole thing in as soon as it's opened
+#define PCACHE_STREAM   2 // big one-shot file: drop pages once the client is past them
+
+#define PCACHE_MAX_PATTERNS 8
+#define PCACHE_WRITE_LAG    (1 << 20) // uploads are dropped this far behind the client, once on disk
+#define PCACHE_SAMPLES      16 // evenly spaced pieces of a file we look at to see how much is resident
+#define PCACHE_SAMPLE_SIZE  (256 << 10)
+
+void pcache_set_threshold(off_t bytes);
+int pcache_add_pattern(const char *pattern);
+
+int pcache_policy(const char *name, int fd, int write);
@@ -0,0 +1,46 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+/* Static tracepoints for the protocol state machine, under the "tftp" provider.
+ * With systemtap's <sys/sdt.h> each one compiles to a single nop plus an ELF note that
+ * bpftrace/perf/stap can attach to at runtime; without it (or with -DNO_PROBES) they vanish.
+ * See scripts/ for bpftrace scripts that use them. Arguments:
+ *
+ *   request       (tid, opcode, filename)
+ *   file_open     (tid, filename, source)  source: 0 file, 1 gzip image, 2 upstream, 3 new file
+ *   data_send     (tid, block, size)
+ *   data_recv     (tid, block, size)
+ *   ack_send      (tid, block)
+ *   ack_recv      (tid, block)
+ *   io_wait       (tid, block)        can't answer until the disk/upstream catches up
+ *   io_resume     (tid, block)
+ *   retransmit    (tid, block, timeouts)
+ *   tid_reject    (tid, bad_tid)
+ *   close         (tid, last_block, bytes, timeouts)
+ *
+ * tid is the client's port as the log messages print it.
+ */
+
+#define PROBE_SOURCE_FILE     0
+#define PROBE_SOURCE_IMAGE    1
+#define PROBE_SOURCE_UPSTREAM 2
+#define PROBE_SOURCE_NEW      3
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(tftp, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef PROBE
+#define PROBE(name, ...) /* No sdt.h; compile to nothing */
+#endif
@@ -0,0 +1,387 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#define _GNU_SOURCE // O_TMPFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "proxy.h"
+#include "iopool.h"
+#include "debug.h"
+
+static struct sockaddr_in upstream;
+static int upstream_set = 0;
+
+static struct fetch *fetches = NULL;
+
+/* Configure the server we fetch misses from, as host or host:port */
+int proxy_set_upstream(const char *hostport) {
+  char host[256];
+  const char *port = "69";
+  struct addrinfo hints, *ai;
+  char *colon;
+  int rv;
+
+  snprintf(host, sizeof(host), "%s", hostport);
+  if ((colon = strrchr(host, ':')) != NULL) {
+    *colon = '\0';
+    port = colon + 1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((rv = getaddrinfo(host, port, &hints, &ai)) != 0) {
+    ERROR_MSG("upstream %s: %s", hostport, gai_strerror(rv));
+    return -1;
+  }
+  memcpy(&upstream, ai->ai_addr, sizeof(upstream));
+  freeaddrinfo(ai);
+
+  upstream_set = 1;
+  LOG(1, "Fetching missing files from %s:%i", inet_ntoa(upstream.sin_addr), ntohs(upstream.sin_port));
+  return 0;
+}
+
+int proxy_enabled() {
+  return upstream_set;
+}
+
+static int send_upstream(struct fetch *fetch, char *buf, int len) {
+  struct sockaddr_in *to = fetch->peer_known ? &fetch->peer : &upstream;
+  if (sendto(fetch->sockfd, buf, len, 0, (struct sockaddr*)to, sizeof(struct sockaddr_in)) != len) {
+    ERROR_MSG("Could not send to upstream for %s: %s", fetch->name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Ask for the file, offering a bigger block size and window than the TFTP defaults
+static int send_request(struct fetch *fetch) {
+  char buf[TFTP_MAX_REQ_BUF_SIZE + 64];
+  int len;
+
+  buf[0] = 0;
+  buf[1] = OP_RRQ;
+  len = TFTP_REQ_HEADER_SIZE;
+  len += sprintf(&buf[len], "%s", fetch->name) + 1;
+  len += sprintf(&buf[len], "octet") + 1;
+  len += sprintf(&buf[len], "blksize") + 1;
+  len += sprintf(&buf[len], "%i", PROXY_BLKSIZE) + 1;
+  len += sprintf(&buf[len], "windowsize") + 1;
+  len += sprintf(&buf[len], "%i", PROXY_WINDOWSIZE) + 1;
+  return send_upstream(fetch, buf, len);
+}
+
+static int send_upstream_ack(struct fetch *fetch) {
+  char buf[TFTP_STD_HEADER_SIZE];
+  unsigned short netshort;
+
+  netshort = htons(OP_ACK);
+  memcpy(&buf[0], &netshort, 2);
+  netshort = htons(fetch->last_block);
+  memcpy(&buf[2], &netshort, 2);
+  fetch->unacked = 0;
+  return send_upstream(fetch, buf, TFTP_STD_HEADER_SIZE);
+}
+
+static void fetch_fail(struct fetch *fetch, int err) {
+  ERROR_MSG("Fetching %s from upstream failed: %s", fetch->name, strerror(err));
+  fetch->err = err;
+  fetch->progress = 1;
+  close(fetch->sockfd);
+  fetch->sockfd = -1;
+  if (!fetch->unnamed) {
+    unlink(fetch->part);
+  }
+}
+
+static void fetch_finish(struct fetch *fetch) {
+  int rv, err;
+
+  LOG(1, "Fetched %s from upstream (%lli bytes)", fetch->name, (long long)fetch->received);
+  fetch->done = 1;
+  fetch->progress = 1;
+  close(fetch->sockfd);
+  fetch->sockfd = -1;
+
+  // From now on the file is served like any other local file. Never over one that turned up
+  // while we were fetching, most likely an upload: that's the copy somebody meant us to have
+  if (fetch->unnamed) {
+    char proc[32];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%i", fetch->fd);
+    rv = linkat(AT_FDCWD, proc, AT_FDCWD, fetch->name, AT_SYMLINK_FOLLOW);
+    err = errno;
+  }
+  else {
+    rv = link(fetch->part, fetch->name);
+    err = errno;
+    unlink(fetch->part);
+  }
+
+  if (rv == 0) {
+    fetch->placed = 1;
+  }
+  else if (err == EEXIST) {
+    LOG(1, "%s turned up locally while we fetched it; keeping that one", fetch->name);
+  }
+  else {
+    ERROR_MSG("Could not move %s into place: %s", fetch->name, strerror(err));
+  }
+}
+
+/* Pick the options we asked for out of an OACK */
+static void parse_oack(struct fetch *fetch, char *buf, int len) {
+  char *p = &buf[TFTP_REQ_HEADER_SIZE], *end = &buf[len];
+
+  while (p < end) {
+    char *name = p, *value;
+    p += strnlen(p, end - p) + 1;
+    if (p >= end) break;
+    value = p;
+    p += strnlen(p, end - p) + 1;
+
+    if (strcasecmp(name, "blksize") == 0) {
+      fetch->blksize = atoi(value);
+    }
+    else if (strcasecmp(name, "windowsize") == 0) {
+      fetch->windowsize = atoi(value);
+    }
+  }
+  if (fetch->blksize < 8 || fetch->blksize > PROXY_BLKSIZE) {
+    fetch->blksize = PROXY_BLKSIZE;
+  }
+  if (fetch->windowsize < 1 || fetch->windowsize > PROXY_WINDOWSIZE) {
+    fetch->windowsize = 1;
+  }
+  LOG(2, "Upstream agreed to blksize %u windowsize %u", fetch->blksize, fetch->windowsize);
+}
+
+/* Take a packet from the upstream */
+static void fetch_recv(struct fetch *fetch, struct timeval *curtime) {
+  char buf[TFTP_STD_HEADER_SIZE + PROXY_BLKSIZE + 1];
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  unsigned short netshort;
+  int len, op, block;
+
+  if ((len = recvfrom(fetch->sockfd, buf, sizeof(buf) - 1, 0, (struct sockaddr*)&from, &fromlen)) < TFTP_STD_HEADER_SIZE) {
+    return;
+  }
+  buf[len] = '\0';
+
+  // The upstream answers from a new port, which is its TID for the rest of the transfer
+  if (!fetch->peer_known) {
+    if (from.sin_addr.s_addr != upstream.sin_addr.s_addr) {
+      return;
+    }
+    fetch->peer = from;
+    fetch->peer_known = 1;
+  }
+  else if (from.sin_port != fetch->peer.sin_port || from.sin_addr.s_addr != fetch->peer.sin_addr.s_addr) {
+    return;
+  }
+
+  memcpy(&netshort, &buf[0], 2);
+  op = ntohs(netshort);
+  memcpy(&netshort, &buf[2], 2);
+  block = ntohs(netshort);
+
+  switch (op) {
+    case OP_ERROR:
+      ERROR_MSG("Upstream error %i for %s: %s", block, fetch->name, &buf[TFTP_STD_HEADER_SIZE]);
+      fetch_fail(fetch, block == ERRCODE_NOTFOUND ? ENOENT : block == ERRCODE_ACCESS ? EACCES : EIO);
+      return;
+
+    case OP_OACK:
+      if (fetch->last_block == 0 && fetch->received == 0) {
+        parse_oack(fetch, buf, len);
+        fetch->last_time = *curtime;
+        fetch->timeouts = 0;
+        send_upstream_ack(fetch);
+      }
+      return;
+
+    case OP_DATA:
+      break;
+
+    default:
+      return;
+  }
+
+  len -= TFTP_STD_HEADER_SIZE;
+  if (block != (fetch->last_block + 1) % TFTP_PACKET_OVERFLOW || len > fetch->blksize) {
+    // Out of order: tell the upstream where to pick up from, once. The rest of its window will
+    // be out of order too, and every ack could make it start the window over again
+    if (!fetch->gap_acked) {
+      send_upstream_ack(fetch);
+      fetch->gap_acked = 1;
+    }
+    return;
+  }
+
+  if (len && pwrite(fetch->fd, &buf[TFTP_STD_HEADER_SIZE], len, fetch->received) != len) {
+    fetch_fail(fetch, errno ? errno : EIO);
+    return;
+  }
+  fetch->received += len;
+  fetch->last_block = block;
+  fetch->gap_acked = 0;
+  fetch->progress = 1;
+  fetch->last_time = *curtime;
+  fetch->timeouts = 0;
+
+  if (len < fetch->blksize) {
+    send_upstream_ack(fetch);
+    fetch_finish(fetch);
+  }
+  else if (++fetch->unacked >= fetch->windowsize) {
+    send_upstream_ack(fetch);
+  }
+}
+
+/* Start fetching name from the upstream, or join a fetch that's already under way */
+struct fetch * proxy_fetch(const char *name) {
+  struct fetch *fetch;
+
+  for (fetch = fetches; fetch != NULL; fetch = fetch->next) {
+    if (!fetch->err && strcmp(fetch->name, name) == 0) {
+      LOG(1, "Joining upstream fetch of %s", name);
+      fetch->refs++;
+      return fetch;
+    }
+  }
+
+  if ((fetch = (struct fetch*)calloc(1, sizeof(struct fetch))) == NULL) {
+    return NULL;
+  }
+  snprintf(fetch->name, sizeof(fetch->name), "%s", name);
+  snprintf(fetch->part, sizeof(fetch->part), "%s%s", PROXY_PART_PREFIX, name);
+  fetch->blksize = TFTP_MAX_BUF_SIZE; // until an OACK says otherwise
+  fetch->windowsize = 1;
+  fetch->refs = 1;
+  gettimeofday(&fetch->last_time, NULL);
+
+  // Without a name nobody can see it half written, and it goes away with us if we die
+  if ((fetch->fd = open(".", O_TMPFILE | O_RDWR, 0644)) != -1) {
+    fetch->unnamed = 1;
+  }
+  else if ((fetch->fd = open(fetch->part, O_CREAT | O_RDWR | O_TRUNC, 0644)) == -1) {
+    free(fetch);
+    return NULL;
+  }
+  if ((fetch->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 || send_request(fetch) == -1) {
+    int err = errno;
+    if (fetch->sockfd != -1) close(fetch->sockfd);
+    close(fetch->fd);
+    if (!fetch->unnamed) {
+      unlink(fetch->part);
+    }
+    free(fetch);
+    errno = err;
+    return NULL;
+  }
+
+  fetch->next = fetches;
+  fetches = fetch;
+
+  LOG(1, "Fetching %s from upstream", name);
+  return fetch;
+}
+
+/* A client is done with the fetch. The fetch itself carries on so the file still gets cached */
+void proxy_release(struct fetch *fetch) {
+  fetch->refs--;
+}
+
+/* Read what the upstream has given us so far through the client's worker pool buffers, which
+ * are never let past what has arrived. Returns the amount read, IOPOOL_PENDING if the upstream
+ * or the disk hasn't got that far, or -1 with errno set if the fetch failed */
+int proxy_read(struct fetch *fetch, struct prefetch *io, off_t offset, char *buf, int len) {
+  if (fetch->err) {
+    errno = fetch->err;
+    return -1;
+  }
+  if (!fetch->done && offset + len > fetch->received) {
+    return IOPOOL_PENDING;
+  }
+  io->avail = fetch->done ? -1 : fetch->received;
+  return iopool_read(io, offset, buf, len);
+}
+
+/* Add the sockets of fetches in flight to set. Returns the highest descriptor, or -1 */
+int proxy_fdset(fd_set *set) {
+  struct fetch *fetch;
+  int max = -1;
+
+  for (fetch = fetches; fetch != NULL; fetch = fetch->next) {
+    if (fetch->sockfd != -1) {
+      FD_SET(fetch->sockfd, set);
+      if (fetch->sockfd > max) {
+        max = fetch->sockfd;
+      }
+    }
+  }
+  return max;
+}
+
+/* Handle upstream packets and timeouts. Returns 1 if any fetch made progress */
+int proxy_poll(fd_set *set, struct timeval *curtime) {
+  struct fetch *fetch;
+  int progress = 0;
+
+  for (fetch = fetches; fetch != NULL; fetch = fetch->next) {
+    if (fetch->sockfd == -1) {
+      continue;
+    }
+    if (FD_ISSET(fetch->sockfd, set)) {
+      fetch_recv(fetch, curtime);
+    }
+    else if (curtime->tv_sec - fetch->last_time.tv_sec >= TIMEOUT) {
+      fetch->last_time = *curtime;
+      if (++fetch->timeouts >= MAX_TIMEOUTS) {
+        fetch_fail(fetch, ETIMEDOUT);
+      }
+      else if (!fetch->peer_known) {
+        send_request(fetch);
+      }
+      else {
+        fetch->gap_acked = 0;
+        send_upstream_ack(fetch);
+      }
+    }
+    progress |= fetch->progress;
+  }
+  return progress;
+}
+
+/* Clear progress flags once clients have had a look, and forget finished fetches nobody reads */
+void proxy_reap() {
+  struct fetch **p = &fetches;
+
+  while (*p != NULL) {
+    struct fetch *fetch = *p;
+    fetch->progress = 0;
+    if ((fetch->done || fetch->err) && fetch->refs == 0) {
+      *p = fetch->next;
+      close(fetch->fd);
+      free(fetch);
+      continue;
+    }
+    p = &fetch->next;
+  }
+}
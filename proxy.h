@@ -0,0 +1,63 @@
+/* Gavin Langdon
+ * Network Programming
+ *
+ * Project #2--TFTP Server
+ * Spring 2013
+ *
+ */
+
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+
+#include "defines.h"
+#include "iopool.h"
+
+#define PROXY_BLKSIZE     1428 // what we ask the upstream for; fits a 1500 byte MTU
+#define PROXY_WINDOWSIZE  16
+#define PROXY_PART_PREFIX ".part."
+
+/* A file being fetched from the upstream server into our directory. Every client that
+ * misses on the same file while it's in flight reads from the same fetch */
+struct fetch {
+  char name[TFTP_MAX_REQ_BUF_SIZE]; // the file as clients asked for it
+  char part[TFTP_MAX_REQ_BUF_SIZE + sizeof(PROXY_PART_PREFIX)]; // where it's written until it's complete
+  int fd; // the partial file
+  int unnamed; // fd is an O_TMPFILE, with no name until it's complete
+  int sockfd; // our socket to the upstream
+  struct sockaddr_in peer; // the upstream's TID, once it has replied
+  int peer_known;
+
+  unsigned blksize; // negotiated with the upstream
+  unsigned windowsize;
+  unsigned last_block; // last in-order block received
+  unsigned unacked; // blocks received since our last ack
+  int gap_acked; // we've asked for a resend after last_block; the upstream doesn't need asking again
+  off_t received; // contiguous bytes on disk
+
+  int done; // the whole file has arrived
+  int placed; // done, and what's under name on disk is what we fetched
+  int err; // errno describing why the fetch failed, or 0
+  int progress; // something changed since the event loop last looked
+  unsigned refs; // clients reading from this fetch
+
+  struct timeval last_time;
+  unsigned timeouts;
+
+  struct fetch *next;
+};
+
+int proxy_set_upstream(const char *hostport);
+int proxy_enabled();
+
+struct fetch * proxy_fetch(const char *name);
+void proxy_release(struct fetch *fetch);
+int proxy_read(struct fetch *fetch, struct prefetch *io, off_t offset, char *buf, int len);
+
+int proxy_fdset(fd_set *set);
+int proxy_poll(fd_set *set, struct timeval *curtime);
+void proxy_reap();